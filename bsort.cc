@@ -1,12 +1,29 @@
 #include <cstdlib>
+#include <getopt.h>
 #include "library.h"
 #include "json/json.h"
 #include "leveldb/db.h" 
 #include "leveldb/comparator.h"
 #include "leveldb/slice.h"
+#include "leveldb/write_batch.h"
 
 using namespace std;
 
+// The length of the input ordinal that follows the normalized sort key in
+// every database key
+static const int ORDINAL_LEN = 8;
+
+// The memory a bulk load uses if none is given
+static const long DEFAULT_BULK_MEMORY = 64L << 20;
+
+// Command line options, which may precede the positional arguments
+static struct option long_options[] = {
+	{"bulk-load", no_argument, NULL, 'b'},
+	{"sorted-ingest", no_argument, NULL, 'i'},
+	{"mem-capacity", required_argument, NULL, 'M'},
+	{NULL, 0, NULL, 0}
+};
+
 /**
  * A custom comparator subclassing leveldb Comparator class.
  * Compares records by the sorting attributes.
@@ -19,43 +36,25 @@ class CustomComparator : public leveldb::Comparator {
 
 	CustomComparator(Schema *schema_passed): leveldb::Comparator() {
 	  schema = schema_passed;
+	  key_len = key_length(schema) + ORDINAL_LEN;
 	}
 
+    // The length of every key: the normalized sort key and the ordinal
+    int key_len;
+
     int Compare(const leveldb::Slice& key1, const leveldb::Slice& key2) const {
 
-      int offset; // offset of an attribute
-      int attr_len; // length of an attribute
-      int attr_idx; // position of an attribute
-
-      Attribute sort_attr;
-	  leveldb::Slice s1_sort_attr;
-      leveldb::Slice s2_sort_attr;
-	  
-	  // Comparing multiple attribute values in slice
-      for(int i = 0; i < schema->n_sort_attrs; i++) {
-        attr_idx = schema->sort_attrs[i];
-        sort_attr = schema->attrs[attr_idx];
-        attr_len = sort_attr.length;
-		offset = sort_attr.offset;
-
-		// Drop the first n-bytes from the key
-		// Create a slice that refers to the contents of the sorting attribute
-		s1_sort_attr = key1;
-		s1_sort_attr.remove_prefix(offset + attr_idx);
-		s1_sort_attr = leveldb::Slice(s1_sort_attr.data(), attr_len);
-
-		s2_sort_attr = key2;
-		s2_sort_attr.remove_prefix(offset + attr_idx);
-		s2_sort_attr = leveldb::Slice(s2_sort_attr.data(), attr_len);
-
-		if (s1_sort_attr.compare(s2_sort_attr) < 0) {
-			return -1;
-		}
-		if (s1_sort_attr.compare(s2_sort_attr) > 0) {
-			return +1;
-		}
+	  // Keys are normalized sort keys (see mk_key), in which the sorting
+	  // attributes are already encoded in priority order, followed by the
+	  // record's big-endian input ordinal, so a single memcmp compares all
+	  // of them and records with equal sort keys keep their input order
+	  int result = memcmp(key1.data(), key2.data(), key_len);
+	  if (result < 0) {
+		  return -1;
+	  }
+	  if (result > 0) {
+		  return +1;
 	  }
-
       return 0;
     }
 
@@ -66,21 +65,50 @@ class CustomComparator : public leveldb::Comparator {
 
 int main(int argc, char* argv[]) {
 
-	if (argc < 5) {
+	// Whether records are loaded in large write batches instead of one Put
+	// at a time
+	bool bulk_load = false;
+
+	// Whether the input is already sorted on the sorting attributes
+	bool sorted_ingest = false;
+
+	// The memory a bulk load may use for write batches and memtables
+	long mem_capacity = DEFAULT_BULK_MEMORY;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "biM:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'b':
+				bulk_load = true;
+				break;
+			case 'i':
+				bulk_load = true;
+				sorted_ingest = true;
+				break;
+			case 'M':
+				mem_capacity = max(1L, atol(optarg));
+				break;
+			default:
+				exit(1);
+		}
+	}
+
+	if (argc - optind < 4) {
 		cout << "ERROR: invalid input parameters!" << endl;
-		cout << "Please enter <schema_file> <input_file> <out_index> <sorting_attributes>" << endl;
+		cout << "Please enter [options] <schema_file> <input_file> <out_index> <sorting_attributes>" << endl;
 		exit(1);
 	}
 
 	// Read in command line arguments
-	string schema_file(argv[1]);
-	char *input_file = argv[2];
-	char *output_file = argv[3];
+	char **args = argv + optind;
+	string schema_file(args[0]);
+	char *input_file = args[1];
+	char *output_file = args[2];
 	std::vector<std::string> sort_attributes; // sorting attribute storage
 
 	// Iterate through the sorting attributes and
 	// put each into the sorting attribute storage
-    for (int i = 4; i < argc; ++i) {
+    for (int i = optind + 3; i < argc; ++i) {
         std::string attr = argv[i];
 		sort_attributes.push_back(attr);
 	}
@@ -102,7 +130,7 @@ int main(int argc, char* argv[]) {
 	Schema schema;
 	schema.nattrs = json_schema.size();
 	schema.attrs = (Attribute*) malloc(sizeof(Attribute) * schema.nattrs);
-	schema.n_sort_attrs = argc - 4;
+	schema.n_sort_attrs = sort_attributes.size();
 	schema.sort_attrs = (int*) malloc(sizeof(int) * schema.n_sort_attrs);
 
 	// Variables for loading an attribute
@@ -120,9 +148,9 @@ int main(int argc, char* argv[]) {
 
 		// Create an Attribute struct for the current attribute
 		Attribute attribute;
-		attribute.name = (char*) malloc(sizeof(attr_name.c_str()));
+		attribute.name = (char*) malloc(attr_name.size() + 1);
 		strcpy(attribute.name, attr_name.c_str());
-		attribute.type = (char*) malloc(sizeof(attr_type.c_str()));
+		attribute.type = (char*) malloc(attr_type.size() + 1);
 		strcpy(attribute.type, attr_type.c_str());
 		attribute.length = attr_len;
 		attribute.offset = schema.total_record_length;
@@ -156,6 +184,21 @@ int main(int argc, char* argv[]) {
 	options.create_if_missing = true;
 	options.comparator = &cmp;
 
+	// A bulk load splits its memory between the write batch being built and
+	// the memtables (the one being filled, and the one being written out
+	// while it fills)
+	long batch_size = mem_capacity / 3;
+	if (bulk_load) {
+		options.write_buffer_size = max(1L, mem_capacity / 3);
+
+		// Sorted input is flushed into tables whose key ranges do not
+		// overlap, which compactions move down the levels without
+		// rewriting them; the larger the tables, the fewer there are
+		if (sorted_ingest) {
+			options.max_file_size = options.write_buffer_size;
+		}
+	}
+
 	// If there exists a database named as the file system directory, raise an error
 	options.error_if_exists = true;
 
@@ -184,16 +227,64 @@ int main(int argc, char* argv[]) {
 	// Read in the header
 	getline(in_file, record);
 
+	// The current record laid out at its schema offsets, the key of the
+	// current record (its normalized key and input ordinal), and the key of
+	// the one before it
+	vector<char> slot(schema.total_record_length);
+	string key_buf(cmp.key_len, '\0');
+	string last_key;
+	uint64_t ordinal = 0;
+
+	// The batch being built, when bulk loading. Nothing is synced to disk
+	// as it is written: the database is only read once the load completes.
+	leveldb::WriteBatch batch;
+	leveldb::WriteOptions write_options;
+	write_options.sync = false;
+
 	// Read in records
 	while (getline(in_file, record)) {
-		// Read in the attributes of the record
-		istringstream recordStream(record);
+		// Build the normalized key from the sorting attributes, once the
+		// record is split at its commas and every attribute padded to its
+		// schema length, exactly as msort does
+		unsigned char *key_bytes = (unsigned char*) &key_buf[0];
+		parse_record(record.data(), record.size(), &schema, &slot[0]);
+		mk_key(&schema, &slot[0], key_bytes);
+		key_bytes += key_length(&schema);
+
+		// Then the ordinal, so that records with equal sort keys get distinct
+		// keys instead of overwriting each other
+		for (int i = ORDINAL_LEN - 1; i >= 0; i--) {
+			key_bytes[i] = (unsigned char) (ordinal >> (8 * (ORDINAL_LEN - 1 - i)));
+		}
+		ordinal++;
 
-		leveldb::Slice key = record;
+		leveldb::Slice key = key_buf;
 		leveldb::Slice value = record;
 
-		// Insert all records into leveldb
-		db->Put(leveldb::WriteOptions(), key, value);
+		// Sorted ingest relies on the keys arriving in order
+		if (sorted_ingest) {
+			if (key_buf < last_key) {
+				cout << "ERROR: input is not sorted on the sorting attributes" << endl;
+				exit(1);
+			}
+			last_key = key_buf;
+		}
+
+		// Insert all records into leveldb, a batch at a time when bulk loading
+		if (!bulk_load) {
+			db->Put(write_options, key, value);
+		} else {
+			batch.Put(key, value);
+			if ((long) batch.ApproximateSize() >= batch_size) {
+				db->Write(write_options, &batch);
+				batch.Clear();
+			}
+		}
+	}
+
+	// Write the last batch
+	if (bulk_load) {
+		db->Write(write_options, &batch);
 	}
 
 	// Close stream
@@ -203,10 +294,11 @@ int main(int argc, char* argv[]) {
 	leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
 	for (it->SeekToFirst(); it->Valid(); it->Next()) {
 		leveldb::Slice value = it->value();
-		std::string val_str = value.ToString();
 
-		// write the record to the output file
-		out_file << val_str << endl;
+		// write the record to the output file (the stream is flushed once,
+		// when it is closed, rather than after every record)
+		out_file.write(value.data(), value.size());
+		out_file << '\n';
 	}
 	// Check for any errors found during the scan
 	assert(it->status().ok());
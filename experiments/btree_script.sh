@@ -4,6 +4,7 @@ DIR="../leveldb_dir"
 OUTPUT1="bsort.out"
 OUTPUT2="msort_poor.out"
 OUTPUT3="msort_good.out"
+OUTPUT4="bsort_bulk.out"
 
 for file in test_records/*; do
 	if [ -d "$DIR" ]; then rm -Rf $DIR; fi
@@ -12,6 +13,12 @@ for file in test_records/*; do
 	{ time ./bsort test_schema.json $file $file.out cgpa; } 2>> $OUTPUT1
 	echo "Finished timing $file." >> $OUTPUT1
 
+	if [ -d "$DIR" ]; then rm -Rf $DIR; fi
+
+	echo "Timing execution of $file..." >> $OUTPUT4
+	{ time ./bsort -b test_schema.json $file $file.out cgpa; } 2>> $OUTPUT4
+	echo "Finished timing $file." >> $OUTPUT4
+
 	echo "Timing execution of $file..." >> $OUTPUT2
 	{ time ./msort test_schema.json $file $file.out 572 2 cgpa; } 2>> $OUTPUT2
 	echo "Finished timing $file." >> $OUTPUT2
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Sorts on a compound key at every mem_capacity from 380 to 3000 bytes (in
+# steps of 3) and reports the capacities at which msort fails, e.g. by
+# running out of its memory budget. Capacities msort refuses up front as too
+# small for the input are counted separately. Exits with status 1 if any
+# run fails.
+INPUT=${1:-"test_records/test_records_1M.csv"}
+OUTPUT="mem_budget.out"
+ATTRS="account_name student_number start_year cgpa"
+failures=0
+too_small=0
+for m in $(seq 380 3 3000); do
+	if ! ./msort test_schema.json $INPUT mem_budget.tmp $m 3 $ATTRS > mem_budget.log 2>&1; then
+		if tail -1 mem_budget.log | grep -q "^ERROR: mem_capacity too small"; then
+			too_small=$((too_small + 1))
+		else
+			echo "mem_capacity = $m failed: $(tail -1 mem_budget.log)" >> $OUTPUT
+			failures=$((failures + 1))
+		fi
+	fi
+done
+rm -f mem_budget.tmp mem_budget.log
+echo "$failures failures, $too_small capacities too small for the input" >> $OUTPUT
+[ $failures -eq 0 ]
@@ -1,329 +1,2022 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <random>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "library.h"
 
-using namespace std;
+using namespace std;
+
+MemoryBudget::MemoryBudget(long capacity) {
+	this->capacity = capacity / BUDGET_ALIGN * BUDGET_ALIGN;
+	this->used = 0;
+	this->peak = 0;
+	this->arena = (char*) malloc(this->capacity > 0 ? this->capacity : 1);
+	if (this->arena == NULL) {
+		cout << "could not allocate " << capacity << " bytes of memory" << endl;
+		exit(1);
+	}
+	if (this->capacity > 0) {
+		this->free_blocks[0] = this->capacity;
+	}
+}
+
+MemoryBudget::~MemoryBudget() {
+	free(this->arena);
+}
+
+char* MemoryBudget::allocate(long bytes) {
+	long size = max(1L, (bytes + BUDGET_ALIGN - 1) / BUDGET_ALIGN) * BUDGET_ALIGN;
+	lock_guard<mutex> lock(this->mtx);
+
+	// Take the first free block that is large enough, leaving the rest free
+	for (auto it = this->free_blocks.begin(); it != this->free_blocks.end(); it++) {
+		if (it->second >= size) {
+			long offset = it->first;
+			long rest = it->second - size;
+			this->free_blocks.erase(it);
+			if (rest > 0) {
+				this->free_blocks[offset + size] = rest;
+			}
+			this->blocks[offset] = size;
+			this->used += size;
+			this->peak = max(this->peak, this->used);
+			return this->arena + offset;
+		}
+	}
+	return NULL;
+}
+
+void MemoryBudget::release(char *ptr) {
+	lock_guard<mutex> lock(this->mtx);
+	auto block = this->blocks.find(ptr - this->arena);
+	long offset = block->first;
+	long size = block->second;
+	this->blocks.erase(block);
+	this->used -= size;
+
+	// Merge the block with the free blocks on either side of it
+	auto next = this->free_blocks.lower_bound(offset);
+	if (next != this->free_blocks.end() && next->first == offset + size) {
+		size += next->second;
+		next = this->free_blocks.erase(next);
+	}
+	if (next != this->free_blocks.begin()) {
+		auto before = prev(next);
+		if (before->first + before->second == offset) {
+			before->second += size;
+			return;
+		}
+	}
+	this->free_blocks[offset] = size;
+}
+
+// The budget budget_alloc allocates from, if any
+static MemoryBudget *current_budget = NULL;
+
+void set_memory_budget(MemoryBudget *budget)
+{
+	current_budget = budget;
+}
+
+MemoryBudget* memory_budget()
+{
+	return current_budget;
+}
+
+char* budget_alloc(long bytes)
+{
+	if (current_budget == NULL) {
+		return (char*) malloc(max(1L, bytes));
+	}
+	char *ptr = current_budget->allocate(bytes);
+	if (ptr == NULL) {
+		cout << "ERROR: mem_capacity exceeded: could not allocate " << bytes << " bytes with " <<
+		     current_budget->used << " of " << current_budget->capacity << " in use" << endl;
+		exit(1);
+	}
+	return ptr;
+}
+
+void budget_free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (current_budget == NULL) {
+		free(ptr);
+	} else {
+		current_budget->release((char*) ptr);
+	}
+}
+
+int key_length(Schema *schema)
+{
+	int key_len = 0;
+	for (int i = 0; i < schema->n_sort_attrs; i++) {
+		Attribute *attr = &schema->attrs[schema->sort_attrs[i]];
+		if ((strcmp(attr->type, INTEGER) == 0) || (strcmp(attr->type, FLOAT) == 0)) {
+			key_len += 8;
+		} else {
+			key_len += attr->length;
+		}
+	}
+	return key_len;
+}
+
+int encode_attr(Attribute *attr, const char* field, unsigned char* key)
+{
+	uint64_t bits;
+	if (strcmp(attr->type, INTEGER) == 0) {
+		// Flipping the sign bit maps the signed range onto the unsigned one
+		bits = (uint64_t) parse_integer(field, attr->length) ^ (1ULL << 63);
+	} else if (strcmp(attr->type, FLOAT) == 0) {
+		// IEEE 754: negative values have all their bits flipped (so that larger
+		// magnitudes sort first), non-negative values just the sign bit
+		double value = parse_numeric(field, attr->length);
+		memcpy(&bits, &value, sizeof(bits));
+		bits = (bits >> 63) ? ~bits : bits | (1ULL << 63);
+	} else {
+		// Strings already compare bytewise. Stop at a null terminator in case
+		// the field is shorter than its schema length.
+		int i = 0;
+		for (; i < attr->length && field[i] != '\0'; i++) {
+			key[i] = field[i];
+		}
+		memset(key + i, 0, attr->length - i);
+		return attr->length;
+	}
+
+	// Store numeric encodings big-endian
+	for (int i = 0; i < 8; i++) {
+		key[i] = (unsigned char) (bits >> (56 - 8 * i));
+	}
+	return 8;
+}
+
+void mk_key(Schema *schema, const char* record, unsigned char* key)
+{
+	for (int i = 0; i < schema->n_sort_attrs; i++) {
+		Attribute *attr = &schema->attrs[schema->sort_attrs[i]];
+		key += encode_attr(attr, record + attr->offset, key);
+	}
+}
+
+RunFormat binary_format(Schema *schema, bool with_keys)
+{
+	RunFormat format;
+	format.key_len = with_keys ? key_length(schema) : 0;
+	format.record_len = schema->total_record_length;
+	format.newline = false;
+	format.stride = format.key_len + format.record_len;
+	return format;
+}
+
+RunFormat text_format(Schema *schema)
+{
+	RunFormat format;
+	format.key_len = 0;
+	format.record_len = schema->total_record_length;
+	format.newline = true;
+	format.stride = format.record_len + 1;
+	return format;
+}
+
+RunFormat key_format(Schema *schema)
+{
+	RunFormat format;
+	format.key_len = key_length(schema);
+	format.record_len = 0;
+	format.newline = false;
+	format.stride = format.key_len;
+	return format;
+}
+
+/**
+ * The number of bytes compared at once when scanning for delimiters, and
+ * a bit mask of the bytes equal to `c` among the VECTOR_SIZE bytes at `p`
+ * (bit i set if p[i] == c)
+ */
+#if defined(__AVX2__)
+static const int VECTOR_SIZE = 32;
+static inline uint32_t match_mask(const char *p, char c) {
+	__m256i bytes = _mm256_loadu_si256((const __m256i*) p);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c)));
+}
+#elif defined(__SSE2__)
+static const int VECTOR_SIZE = 16;
+static inline uint32_t match_mask(const char *p, char c) {
+	__m128i bytes = _mm_loadu_si128((const __m128i*) p);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+#else
+static const int VECTOR_SIZE = 8;
+static inline uint32_t match_mask(const char *p, char c) {
+	uint32_t mask = 0;
+	for (int i = 0; i < VECTOR_SIZE; i++) {
+		mask |= (uint32_t) (p[i] == c) << i;
+	}
+	return mask;
+}
+#endif
+
+const char* find_char(const char *begin, const char *end, char c)
+{
+	const char *p = begin;
+	for (; p + VECTOR_SIZE <= end; p += VECTOR_SIZE) {
+		uint32_t mask = match_mask(p, c);
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	for (; p < end; p++) {
+		if (*p == c) {
+			return p;
+		}
+	}
+	return end;
+}
+
+void parse_record(const char *line, long len, Schema *schema, char *record)
+{
+	// Strip the trailing carriage return, if any
+	const char *end = line + len;
+	if (end > line && end[-1] == '\r') {
+		end--;
+	}
+
+	// The number of attributes sliced so far, and where the next one starts
+	int num_fields = 0;
+	const char *field = line;
+	bool valid = true;
+
+	// Lambda for copying the attribute ending at `delim` to its offset,
+	// padded with spaces. An attribute cannot be longer than its schema
+	// length, and there cannot be more attributes than the schema has.
+	auto end_field = [&] (const char *delim) {
+		if (num_fields == schema->nattrs ||
+			delim - field > schema->attrs[num_fields].length) {
+			valid = false;
+			return;
+		}
+		Attribute *attr = &schema->attrs[num_fields];
+		memcpy(record + attr->offset, field, delim - field);
+		memset(record + attr->offset + (delim - field), ' ', attr->length - (delim - field));
+		num_fields++;
+		field = delim + 1;
+	};
+
+	// Find the commas a vector at a time, then in the last few bytes
+	const char *p = line;
+	for (; p + VECTOR_SIZE <= end && valid; p += VECTOR_SIZE) {
+		uint32_t mask = match_mask(p, ',');
+		while (mask != 0 && valid) {
+			end_field(p + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+	for (; p < end && valid; p++) {
+		if (*p == ',') {
+			end_field(p);
+		}
+	}
+	if (valid) {
+		end_field(end);
+	}
+
+	if (!valid || num_fields != schema->nattrs) {
+		cout << "ERROR: invalid record: " << string(line, len) << endl;
+		exit(1);
+	}
+}
+
+long line_block_size()
+{
+	MemoryBudget *budget = memory_budget();
+	if (budget == NULL) {
+		return LINE_BLOCK_SIZE;
+	}
+	return max(128L, min(LINE_BLOCK_SIZE, budget->capacity / 16));
+}
+
+long output_block_size(RunFormat format)
+{
+	MemoryBudget *budget = memory_budget();
+	if (budget == NULL) {
+		return LINE_BLOCK_SIZE;
+	}
+	return max((long) format.stride, min(LINE_BLOCK_SIZE, budget->capacity / 16));
+}
+
+long max_line_length(Schema *schema)
+{
+	return schema->total_record_length + schema->nattrs + 1;
+}
+
+LineReader::LineReader(char *filename) {
+	this->fd = open(filename, O_RDONLY);
+	if (this->fd < 0) {
+		cout << "could not open " << filename << " to read records" << endl;
+		exit(1);
+	}
+	this->block.resize(line_block_size());
+	this->begin = 0;
+	this->end = 0;
+	this->eof = false;
+}
+
+LineReader::~LineReader() {
+	close(this->fd);
+}
+
+bool LineReader::next(const char **line, long *len) {
+	while (true) {
+		// Return the next complete line in the block
+		char *data = &this->block[0];
+		const char *newline = find_char(data + this->begin, data + this->end, '\n');
+		if (newline != data + this->end || (this->eof && this->begin < this->end)) {
+			*line = data + this->begin;
+			*len = newline - *line;
+			this->begin = newline - data + 1;
+			return true;
+		}
+		if (this->eof) {
+			return false;
+		}
+
+		// Otherwise move the partial line to the front of the block (growing
+		// the block if the line fills it) and read the next block after it
+		this->end -= this->begin;
+		memmove(data, data + this->begin, this->end);
+		this->begin = 0;
+		if (this->end == (long) this->block.size()) {
+			this->block.resize(2 * this->block.size());
+		}
+		ssize_t n = read(this->fd, &this->block[this->end], this->block.size() - this->end);
+		if (n <= 0) {
+			this->eof = true;
+		} else {
+			this->end += n;
+		}
+	}
+}
+
+RunFormat arena_format(Schema *schema)
+{
+	return binary_format(schema, true);
+}
+
+void fill_slot(const char *line, long len, Schema *schema, char *slot)
+{
+	int key_len = key_length(schema);
+	parse_record(line, len, schema, slot + key_len);
+	mk_key(schema, slot + key_len, (unsigned char*) slot);
+}
+
+long run_capacity(long mem_capacity, Schema *schema, RunFormat format, int num_threads)
+{
+	// Each run (each worker's, with more than one thread) allocates its
+	// arena, its entries, its output and, with threads, its lines. A single
+	// thread also keeps the smallest and largest keys of the last run.
+	long out_stride = max(format.stride, text_format(schema).stride);
+	long record_cost = arena_format(schema).stride + sizeof(SlotEntry) + out_stride;
+	if (num_threads > 1) {
+		record_cost += max_line_length(schema);
+	}
+	long available = mem_capacity - budget_size(line_block_size(), 1) -
+	                 (num_threads > 1 ? budget_size(0, 4 * num_threads) :
+	                  budget_size(2 * key_length(schema), 5));
+	return max(0L, available / record_cost);
+}
+
+long replacement_capacity(long mem_capacity, Schema *schema)
+{
+	// Each record takes a slot, its key, and a heap entry; there is also
+	// the key of the last record written, and the output buffer
+	int key_len = key_length(schema);
+	long record_cost = schema->total_record_length + key_len + sizeof(pair<long, SortEntry>);
+	long available = mem_capacity - budget_size(line_block_size(), 1) -
+	                 budget_size(output_block_size(binary_format(schema, true)), 1) -
+	                 budget_size(key_len, 4);
+	return max(0L, available / record_cost);
+}
+
+// Buckets smaller than this are sorted by comparison instead of by radix
+static const long RADIX_CUTOFF = 64;
+
+// The longest key sorted by radix
+static const int RADIX_MAX_KEY_LEN = 32;
+
+/**
+ * Whether sort_run sorts by radix. Integer and fixed-length string keys
+ * spread their records across the key bytes, so an MSD radix sort takes a
+ * few linear passes. Float keys share their leading sign and exponent bits,
+ * so radix passes over them would mostly find a single bucket; they are
+ * sorted by comparison, as are keys too long for radix to pay off.
+ */
+static bool use_radix_sort(Schema *schema)
+{
+	for (int i = 0; i < schema->n_sort_attrs; i++) {
+		if (strcmp(schema->attrs[schema->sort_attrs[i]].type, FLOAT) == 0) {
+			return false;
+		}
+	}
+	return key_length(schema) <= RADIX_MAX_KEY_LEN;
+}
+
+/**
+ * Sorts the entries in [begin, end), which agree on the first `depth` bytes
+ * of their keys, by an in-place MSD radix sort (American flag sort) on the
+ * remaining bytes. Small buckets are sorted by `comp`.
+ */
+template <typename Compare>
+static void radix_sort(SlotEntry *begin, SlotEntry *end, int depth, int key_len, Compare comp)
+{
+	if (end - begin < RADIX_CUTOFF) {
+		sort(begin, end, comp);
+		return;
+	}
+	if (depth == key_len) {
+		return;
+	}
+
+	// The key byte at `depth` (the first 8 bytes are in the prefix)
+	auto key_byte = [depth] (const SlotEntry& e) {
+		return depth < 8 ? (int) ((e.prefix >> (56 - 8 * depth)) & 0xff)
+		                 : (int) (unsigned char) e.key[depth];
+	};
+
+	// Count the entries in each bucket, and find where each bucket starts
+	long counts[256] = {0};
+	for (SlotEntry *e = begin; e != end; e++) {
+		counts[key_byte(*e)]++;
+	}
+	long next[256];
+	long bucket_end[256];
+	long pos = 0;
+	for (int b = 0; b < 256; b++) {
+		next[b] = pos;
+		pos += counts[b];
+		bucket_end[b] = pos;
+	}
+
+	// Move every entry into its bucket, following cycles of swaps
+	for (int b = 0; b < 256; b++) {
+		while (next[b] < bucket_end[b]) {
+			SlotEntry e = begin[next[b]];
+			int v = key_byte(e);
+			while (v != b) {
+				swap(e, begin[next[v]++]);
+				v = key_byte(e);
+			}
+			begin[next[b]++] = e;
+		}
+	}
+
+	// Sort each bucket on the next byte
+	for (int b = 0; b < 256; b++) {
+		long start = bucket_end[b] - counts[b];
+		if (counts[b] > 1) {
+			radix_sort(begin + start, begin + bucket_end[b], depth + 1, key_len, comp);
+		}
+	}
+}
+
+void sort_run(char *records, long num_records, Schema *schema, RunFormat format,
+              RunFormat out_format, char *out)
+{
+	// The records are sorted through (key prefix, key) pairs, so only the
+	// pairs move. Keys are only compared in full when their prefixes tie.
+	// Keys stored in front of the records are used in place; otherwise each
+	// is built once, up front.
+	int key_len = key_length(schema);
+	int record_len = format.record_len;
+	bool keys_stored = format.key_len > 0;
+	BudgetVector<char> keys(keys_stored ? 0 : num_records * key_len);
+	BudgetVector<SlotEntry> entries(num_records);
+	for (long i = 0; i < num_records; i++) {
+		char *record = records + i * format.stride;
+		if (keys_stored) {
+			entries[i].key = record;
+		} else {
+			entries[i].key = &keys[i * key_len];
+			mk_key(schema, record, (unsigned char*) entries[i].key);
+		}
+		entries[i].prefix = key_prefix((unsigned char*) entries[i].key, key_len);
+	}
+
+	// Lambda for comparing records by key prefix, then by full key
+	auto comp = [key_len] (const SlotEntry& e1, const SlotEntry& e2) {
+		if (e1.prefix != e2.prefix) {
+			return e1.prefix < e2.prefix;
+		}
+		return memcmp(e1.key, e2.key, key_len) < 0;
+	};
+
+	// sort the records in this run, by radix if the key suits it
+	if (use_radix_sort(schema) && num_records > 0) {
+		radix_sort(&entries[0], &entries[0] + num_records, 0, key_len, comp);
+	} else {
+		sort(entries.begin(), entries.end(), comp);
+	}
+
+	// Lay the records out in the output format: its key (if keys are
+	// stored), then the record, then a newline (text format only). A built
+	// key's position among the keys is its record's index.
+	for (long i = 0; i < num_records; i++) {
+		char *key = entries[i].key;
+		char *record = keys_stored ? key + format.key_len :
+		               records + (key - keys.data()) / key_len * format.stride;
+		char *entry = out + i * out_format.stride;
+		memcpy(entry, key, out_format.key_len);
+		memcpy(entry + out_format.key_len, record, record_len);
+		if (out_format.newline) {
+			entry[out_format.stride - 1] = '\n';
+		}
+	}
+}
+
+/**
+ * Lays the `num_records` records in the arena `slots` out in `format` in
+ * `out`, in the order they are in the arena, or in reverse
+ */
+static void copy_slots(char *slots, long num_records, Schema *schema, RunFormat format,
+                       bool reverse, char *out)
+{
+	int key_len = key_length(schema);
+	int record_len = schema->total_record_length;
+	long slot_size = key_len + record_len;
+	for (long i = 0; i < num_records; i++) {
+		char *slot = slots + (reverse ? num_records - 1 - i : i) * slot_size;
+		char *entry = out + i * format.stride;
+		memcpy(entry, slot, format.key_len);
+		memcpy(entry + format.key_len, slot + key_len, record_len);
+		if (format.newline) {
+			entry[format.stride - 1] = '\n';
+		}
+	}
+}
+
+/**
+ * Rewrites `run`, laid out in `from`, in `to` at `out_pos` of the open file
+ * `fd` (advancing `out_pos`), a section at a time through the `buf_size`
+ * bytes of `buf`, and frees the disk space of its old copy
+ */
+static void convert_run(int fd, Run &run, RunFormat from, RunFormat to, Schema *schema,
+                        char *buf, long buf_size, long &out_pos)
+{
+	int record_len = schema->total_record_length;
+	long section_length = max(1L, buf_size / (from.stride + to.stride));
+	char *in = buf;
+	char *out = buf + section_length * from.stride;
+	long start_pos = out_pos;
+	for (long done = 0; done < run.length; done += section_length) {
+		long n = min(section_length, run.length - done);
+		pread_fully(fd, in, n * from.stride, run.start_pos + done * from.stride);
+		for (long i = 0; i < n; i++) {
+			char *record = in + i * from.stride + from.key_len;
+			char *entry = out + i * to.stride;
+			if (to.key_len == 0 || from.key_len == to.key_len) {
+				memcpy(entry, record - from.key_len, to.key_len);
+			} else {
+				mk_key(schema, record, (unsigned char*) entry);
+			}
+			memcpy(entry + to.key_len, record, record_len);
+			if (to.newline) {
+				entry[to.stride - 1] = '\n';
+			}
+		}
+		pwrite_fully(fd, out, n * to.stride, out_pos);
+		out_pos += n * to.stride;
+	}
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run.start_pos,
+	          run.length * from.stride);
+	run.start_pos = start_pos;
+}
+
+int mk_runs(char *in_filename, char *out_filename, long run_length, Schema *schema,
+            RunFormat format, RunFormat single_format, BudgetVector<Run> &runs, bool &ordered)
+{
+	// Reader for the input, and file for writing sorted runs
+	LineReader in_file(in_filename);
+	int out_fd = open(out_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	// Error if unable to open the file
+	if (out_fd < 0) {
+		cout << "could not open " << out_filename << " to create runs" << endl;
+		exit(1);
+	}
+
+	// The current record being read
+	const char *record;
+	long record_len;
+
+	// The arena holding the records of the current run, the number of
+	// records in it, and the run once sorted. All three are allocated once.
+	int key_len = key_length(schema);
+	long slot_size = arena_format(schema).stride;
+	BudgetVector<char> arena(run_length * slot_size);
+	long run_records = 0;
+	BudgetVector<char> sorted(run_length * max(format.stride, single_format.stride));
+
+	// The smallest and largest keys of the last run written
+	BudgetVector<char> last_min(key_len);
+	BudgetVector<char> last_max(key_len);
+
+	// The position in the file of the next run
+	long out_pos = 0;
+
+	// Whether the runs written so far are ordered (and so laid out in
+	// `single_format`), and whether they are in descending order
+	ordered = true;
+	bool descending_runs = false;
+
+	// Lambda for sorting the current run and writing it to the file.
+	// `last` is set if it holds the last records of the input.
+	auto write_run = [&] (bool last) {
+
+		// Find out whether the records arrived in order, and find the
+		// smallest and largest keys
+		bool ascending = true;
+		bool descending = true;
+		char *min_slot = &arena[0];
+		char *max_slot = &arena[0];
+		for (long i = 1; i < run_records; i++) {
+			char *slot = &arena[i * slot_size];
+			int c = memcmp(slot, slot - slot_size, key_len);
+			ascending = ascending && c >= 0;
+			descending = descending && c <= 0;
+			if (memcmp(slot, min_slot, key_len) < 0) {
+				min_slot = slot;
+			}
+			if (memcmp(slot, max_slot, key_len) > 0) {
+				max_slot = slot;
+			}
+		}
+
+		// The run continues the last run if its keys start where that
+		// one's left off, or precedes it if they end where it starts
+		bool follows = !runs.empty() && memcmp(min_slot, &last_max[0], key_len) >= 0;
+		bool precedes = !runs.empty() && memcmp(max_slot, &last_min[0], key_len) <= 0;
+
+		// A first run that had to be sorted is unlikely to be followed by
+		// ordered runs, so unless it's the only one, it goes in `format`
+		if (runs.empty() && !last && !ascending && !descending) {
+			ordered = false;
+		}
+
+		// Runs out of order: rewrite any runs written in `single_format`
+		if (ordered && !runs.empty() && !(follows && !descending_runs) &&
+			!(precedes && (descending_runs || runs.size() == 1))) {
+			ordered = false;
+			descending_runs = false;
+			long end = out_pos;
+			for (size_t r = 0; r < runs.size(); r++) {
+				convert_run(out_fd, runs[r], single_format, format, schema, &sorted[0],
+				            sorted.size(), end);
+			}
+			out_pos = end;
+		}
+		RunFormat run_format = ordered ? single_format : format;
+
+		// Sort the run, unless it's already in order
+		if (ascending || descending) {
+			copy_slots(&arena[0], run_records, schema, run_format, !ascending, &sorted[0]);
+		} else {
+			sort_run(&arena[0], run_records, schema, arena_format(schema), run_format, &sorted[0]);
+		}
+		pwrite_fully(out_fd, &sorted[0], run_records * run_format.stride, out_pos);
+
+		// Extend the last run if this one follows it in the file and in
+		// key order; otherwise record a new run
+		Run *prev = runs.empty() ? NULL : &runs.back();
+		if (follows && !descending_runs &&
+			prev->start_pos + prev->length * run_format.stride == out_pos) {
+			prev->length += run_records;
+		} else {
+			descending_runs = descending_runs || (ordered && precedes);
+			Run run {out_pos, run_records};
+			runs.push_back(run);
+			memcpy(&last_min[0], min_slot, key_len);
+		}
+		memcpy(&last_max[0], max_slot, key_len);
+
+		// empty the arena
+		out_pos += run_records * run_format.stride;
+		run_records = 0;
+	};
+	
+	// Read in the header (we assume that the schema contains the same
+	// information, so this can be ignored).
+	in_file.next(&record, &record_len);
+
+	// Read each record straight into the next slot of the arena
+	while (in_file.next(&record, &record_len)) {
+
+		// If we've completed a run, sort it and write it to the file
+		if (run_records == run_length) {
+			write_run(false);
+		}
+		fill_slot(record, record_len, schema, &arena[run_records * slot_size]);
+		run_records++;
+	}
+
+	// Sort and write any remaining records
+	if (run_records > 0) {
+		write_run(true);
+	}
+
+	// Runs in descending order are sorted when concatenated in reverse
+	if (ordered) {
+		reverse(runs.begin(), runs.end());
+	}
+
+	// Close file
+	close(out_fd);
+
+	return runs.size();
+}
+
+int mk_runs_parallel(char *in_filename, char *out_filename, long run_length, Schema *schema,
+                     RunFormat format, int num_threads, BudgetVector<Run> &runs)
+{
+	// Reader for the input, and file for writing sorted runs
+	LineReader in_file(in_filename);
+	int out_fd = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	// Error if unable to open the file
+	if (out_fd < 0) {
+		cout << "could not open " << out_filename << " to create runs" << endl;
+		exit(1);
+	}
+
+	// The records that fit in memory are split evenly between the runs
+	// being worked on at once, one per worker (but no more runs than there
+	// are records to split)
+	long max_in_flight = max(1L, min((long) num_threads, run_length));
+	long chunk_length = max(1L, run_length / max_in_flight);
+
+	// State shared by the pipeline stages, guarded by `mtx`
+	mutex mtx;
+	condition_variable cv;
+	deque<RunChunk*> unsorted;        // read, waiting for a worker
+	map<long, RunChunk*> sorted;      // sorted, waiting for the writer
+	long in_flight = 0;               // read but not yet written
+	long num_chunks = 0;              // the number of runs read so far
+	bool reading = true;              // whether the reader is still running
+
+	// Reader: cuts the input into runs, never holding more runs in memory
+	// than there are workers
+	thread reader([&] () {
+		const char *record;
+		long record_len;
+
+		// Read in the header (we assume that the schema contains the same
+		// information, so this can be ignored).
+		in_file.next(&record, &record_len);
+
+		while (true) {
+			{
+				unique_lock<mutex> lock(mtx);
+				cv.wait(lock, [&] { return in_flight < max_in_flight; });
+				in_flight++;
+			}
+
+			RunChunk *chunk = new RunChunk;
+			chunk->length = 0;
+			chunk->lines.reserve(chunk_length * max_line_length(schema));
+			while (chunk->length < chunk_length && in_file.next(&record, &record_len)) {
+				chunk->lines.insert(chunk->lines.end(), record, record + record_len);
+				chunk->lines.push_back('\n');
+				chunk->length++;
+			}
+
+			lock_guard<mutex> lock(mtx);
+			if (chunk->length == 0) {
+				delete chunk;
+				in_flight--;
+				break;
+			}
+			chunk->seq = num_chunks++;
+			unsorted.push_back(chunk);
+			cv.notify_all();
+		}
+
+		lock_guard<mutex> lock(mtx);
+		reading = false;
+		cv.notify_all();
+	});
+
+	// Workers: parse and sort one run at a time
+	long slot_size = arena_format(schema).stride;
+	vector<thread> workers;
+	for (int i = 0; i < num_threads; i++) {
+		workers.push_back(thread([&] () {
+			while (true) {
+				RunChunk *chunk;
+				{
+					unique_lock<mutex> lock(mtx);
+					cv.wait(lock, [&] { return !unsorted.empty() || !reading; });
+					if (unsorted.empty()) {
+						return;
+					}
+					chunk = unsorted.front();
+					unsorted.pop_front();
+				}
+
+				// Slice the lines into an arena, then sort it
+				BudgetVector<char> arena(chunk->length * slot_size);
+				const char *line = chunk->lines.data();
+				const char *end = line + chunk->lines.size();
+				for (long i = 0; i < chunk->length; i++) {
+					const char *newline = find_char(line, end, '\n');
+					fill_slot(line, newline - line, schema, &arena[i * slot_size]);
+					line = newline + 1;
+				}
+				BudgetVector<char>().swap(chunk->lines);
+				chunk->sorted.resize(chunk->length * format.stride);
+				sort_run(&arena[0], chunk->length, schema, arena_format(schema), format,
+				         &chunk->sorted[0]);
+
+				lock_guard<mutex> lock(mtx);
+				sorted[chunk->seq] = chunk;
+				cv.notify_all();
+			}
+		}));
+	}
+
+	// Writer (this thread): writes the sorted runs out in input order
+	long pos = 0;
+	for (long seq = 0; ; seq++) {
+		RunChunk *chunk;
+		{
+			unique_lock<mutex> lock(mtx);
+			cv.wait(lock, [&] { return sorted.count(seq) > 0 || (!reading && seq == num_chunks); });
+			if (sorted.count(seq) == 0) {
+				break;
+			}
+			chunk = sorted[seq];
+			sorted.erase(seq);
+		}
+
+		pwrite_fully(out_fd, chunk->sorted.data(), chunk->sorted.size(), pos);
+		Run run {pos, chunk->length};
+		runs.push_back(run);
+		pos += chunk->sorted.size();
+		delete chunk;
+
+		lock_guard<mutex> lock(mtx);
+		in_flight--;
+		cv.notify_all();
+	}
+
+	reader.join();
+	for (auto it = workers.begin(); it != workers.end(); it++) {
+		it->join();
+	}
+
+	// Close file
+	close(out_fd);
+
+	return runs.size();
+}
+
+int mk_runs_replacement(char *in_filename, char *out_filename, long heap_capacity,
+                        Schema *schema, RunFormat format, BudgetVector<Run> &runs)
+{
+	// Reader for the input, and file for writing sorted runs
+	LineReader in_file(in_filename);
+	int out_fd = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	// Error if unable to open the file
+	if (out_fd < 0) {
+		cout << "could not open " << out_filename << " to create runs" << endl;
+		exit(1);
+	}
+
+	int record_len = schema->total_record_length;
+	int key_len = key_length(schema);
+
+	// Records are written through a buffer of a block's worth of them
+	OutputBuffer out(out_fd, 0, format, NULL, output_block_size(format), NULL);
+
+	// Fixed-width record slots and their normalized keys. A slot is refilled
+	// from the input as soon as its record has been written out.
+	BudgetVector<char> slots(heap_capacity * record_len);
+	BudgetVector<unsigned char> slot_keys(heap_capacity * key_len);
+
+	// The key of the last record written to the current run
+	BudgetVector<unsigned char> last_key(key_len);
+
+	// The heap holds (run number, record) pairs. Records are ordered by the
+	// run they belong to before their keys, so records that arrive too late
+	// for the current run sink below it and wait for the next one.
+	typedef pair<long, SortEntry> HeapEntry;
+	BudgetVector<HeapEntry> heap;
+	heap.reserve(heap_capacity);
+
+	// Lambda for ordering heap entries. The STL heap functions build a
+	// max-heap, so this returns true if e1 should come out after e2.
+	auto comp = [key_len] (const HeapEntry& e1, const HeapEntry& e2) {
+		if (e1.first != e2.first) {
+			return e1.first > e2.first;
+		}
+		if (e1.second.prefix != e2.second.prefix) {
+			return e1.second.prefix > e2.second.prefix;
+		}
+		return memcmp(e1.second.key, e2.second.key, key_len) > 0;
+	};
+
+	// The current record being read
+	const char *record;
+	long line_len;
+
+	// Lambda for reading the next record into slot `idx`. Returns false once
+	// the input is exhausted.
+	auto read_record = [&] (long idx, SortEntry& entry) {
+		if (!in_file.next(&record, &line_len)) {
+			return false;
+		}
+		char *slot = &slots[idx * record_len];
+		parse_record(record, line_len, schema, slot);
+
+		// Build the record's normalized key
+		entry.idx = idx;
+		entry.key = &slot_keys[idx * key_len];
+		mk_key(schema, slot, entry.key);
+		entry.prefix = key_prefix(entry.key, key_len);
+		return true;
+	};
+
+	// Read in the header (we assume that the schema contains the same
+	// information, so this can be ignored).
+	in_file.next(&record, &line_len);
+
+	// Fill the heap. All of the initial records belong to the first run.
+	SortEntry entry;
+	while ((long) heap.size() < heap_capacity && read_record(heap.size(), entry)) {
+		heap.push_back(HeapEntry(0, entry));
+	}
+	make_heap(heap.begin(), heap.end(), comp);
+
+	// The run currently being written
+	long cur_run = 0;
+	Run run {0, 0};
 
-int mk_runs(char *in_filename, char *out_filename, long run_length, Schema *schema)
-{
-  	// Streams for reading in data and writing sorted runs
-	ifstream in_file(in_filename);
-	ofstream out_file(out_filename);
+	// The number of records written so far (across all runs)
+	long records_written = 0;
 
-	// Error if unable to open streams
-	if (!in_file.is_open()) {
-    	cout << "could not open " << in_filename << " to create runs" << endl;
-    	exit(1);
-  	} else if (!out_file.is_open()) {
-  		cout << "could not open " << out_filename << " to create runs" << endl;
-    	exit(1);
-  	}
+	while (!heap.empty()) {
 
-	// The current record being read
-	string record;
+		// Take the smallest record off the heap
+		pop_heap(heap.begin(), heap.end(), comp);
+		HeapEntry top = heap.back();
+		heap.pop_back();
 
-	// Stores the current attribute of the current record
-	string attribute;
+		// If it belongs to the next run, the current run is complete
+		if (top.first != cur_run) {
+			runs.push_back(run);
+			run.start_pos = records_written * format.stride;
+			run.length = 0;
+			cur_run = top.first;
+		}
+
+		// Write the record to the current run
+		out.append(top.second.key, &slots[top.second.idx * record_len]);
+		memcpy(&last_key[0], top.second.key, key_len);
+		run.length++;
+		records_written++;
+
+		// Replace it with the next input record. That record can still join
+		// the current run unless it sorts before the record just written.
+		if (read_record(top.second.idx, entry)) {
+			bool too_late = memcmp(entry.key, &last_key[0], key_len) < 0;
+			heap.push_back(HeapEntry(too_late ? cur_run + 1 : cur_run, entry));
+			push_heap(heap.begin(), heap.end(), comp);
+		}
+	}
 
-	// Vector for the current record
-	vector<string> record_vect;
+	// Record the final run
+	if (run.length > 0) {
+		runs.push_back(run);
+	}
 
-	// Vector to hold all records in the current run
-	vector<vector<string>> run_records;
+	// Write out the last records and close the file
+	out.finish();
+	close(out_fd);
 
-	// The global index of the current record (across all runs)
-	int record_idx = 0;
+	return runs.size();
+}
 
-	// The number of runs created
-	int num_runs = 0;
+long sample_keys(char *in_filename, Schema *schema, long num_samples, BudgetVector<char> *samples)
+{
+	int fd = open(in_filename, O_RDONLY);
+	if (fd < 0) {
+		cout << "could not open " << in_filename << " to sample records" << endl;
+		exit(1);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	long file_size = st.st_size;
 
-	// The attribute to sort on
-	// TODO: support multi-attribute sorting
-	int sort_attr_idx = schema->sort_attrs[0];
-	Attribute sort_attr = schema->attrs[sort_attr_idx];
-	bool is_numeric = (strcmp(sort_attr.type, INTEGER) == 0) || (strcmp(sort_attr.type, FLOAT) == 0);
+	// A window large enough to hold the rest of one line and all of the next
+	// (every attribute at full length, with its delimiter and a CRLF)
+	long max_line = max_line_length(schema);
+	BudgetVector<char> window(2 * max_line);
+	BudgetVector<char> record(schema->total_record_length);
+	int key_len = key_length(schema);
+	if (samples != NULL) {
+		samples->clear();
+		samples->reserve(num_samples * key_len);
+	}
 
-	// Lambda for comparing records
-	auto comp = [sort_attr_idx, is_numeric] (vector<string> r1, vector<string> r2) {
-		if (is_numeric) {
-			return atof(r1[sort_attr_idx].c_str()) < atof(r2[sort_attr_idx].c_str());
-		} else {
-			return r1[sort_attr_idx] < r2[sort_attr_idx];
+	// Skip the header
+	long header_len = pread_fully(fd, &window[0], window.size(), 0);
+	char *eol = (char*) memchr(&window[0], '\n', header_len);
+	long data_start = eol != NULL ? eol - &window[0] + 1 : file_size;
+
+	// Read the first full line after each of `num_samples` random positions
+	mt19937_64 rng(file_size);
+	long sampled_lines = 0;
+	long sampled_bytes = 0;
+	for (long i = 0; i < num_samples && data_start < file_size; i++) {
+		long pos = data_start + rng() % (file_size - data_start);
+		long len = pread_fully(fd, &window[0], window.size(), pos - 1);
+		char *begin = (char*) memchr(&window[0], '\n', len);
+		if (begin == NULL) {
+			continue;
 		}
-	};
-	
+		begin++;
+		char *end = (char*) memchr(begin, '\n', &window[0] + len - begin);
+		if (end == NULL) {
+			continue;
+		}
+		if (samples != NULL) {
+			parse_record(begin, end - begin, schema, &record[0]);
+			samples->resize(samples->size() + key_len);
+			mk_key(schema, &record[0], (unsigned char*) &(*samples)[samples->size() - key_len]);
+		}
+		sampled_lines++;
+		sampled_bytes += end - begin + 1;
+	}
+	close(fd);
+
+	// Sort the keys (normalized keys compare bytewise)
+	if (samples != NULL && sampled_lines > 0) {
+		BudgetVector<char> sorted(samples->size());
+		sort_run(&(*samples)[0], sampled_lines, schema, key_format(schema), key_format(schema),
+		         &sorted[0]);
+		samples->swap(sorted);
+	}
+
+	// Estimate the number of records from the average length of a line
+	if (sampled_lines == 0) {
+		return 0;
+	}
+	return (file_size - data_start) * sampled_lines / sampled_bytes + 1;
+}
+
+long sample_capacity(long mem_capacity, Schema *schema)
+{
+	// Besides sample_keys' window and record, each key takes its place
+	// among the samples, in their sorted copy, and a SlotEntry
+	long available = mem_capacity - budget_size(2 * max_line_length(schema) +
+	                                            schema->total_record_length, 5);
+	return max(0L, available / (2 * key_length(schema) + (long) sizeof(SlotEntry)));
+}
+
+void mk_partitions(char *in_filename, vector<string> &part_filenames, BudgetVector<char> &splitters,
+                   Schema *schema, RunFormat format, long mem_capacity,
+                   vector<long> &part_lengths)
+{
+	LineReader in_file(in_filename);
+	int key_len = key_length(schema);
+
+	// One output buffer per partition, sharing the memory left over from
+	// the reader, the splitters, and the current record and its key, but no
+	// larger than a block
+	int num_parts = part_filenames.size();
+	long available = mem_capacity - budget_size(line_block_size() + splitters.size() +
+	                                            format.stride + key_len, num_parts + 4);
+	long part_buf_size = max((long) format.stride, min(output_block_size(format), available / num_parts));
+	vector<int> part_fds(num_parts);
+	vector<OutputBuffer*> part_bufs(num_parts);
+	for (int p = 0; p < num_parts; p++) {
+		part_fds[p] = open(part_filenames[p].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (part_fds[p] < 0) {
+			cout << "could not open " << part_filenames[p] << " to create partitions" << endl;
+			exit(1);
+		}
+		part_bufs[p] = new OutputBuffer(part_fds[p], 0, format, NULL, part_buf_size, NULL);
+	}
+	part_lengths.assign(num_parts, 0);
+
+	// The current record and its key
+	const char *record;
+	long record_len;
+	BudgetVector<char> slot(schema->total_record_length);
+	BudgetVector<unsigned char> key(key_len);
+
 	// Read in the header (we assume that the schema contains the same
 	// information, so this can be ignored).
-	getline(in_file, record);
+	in_file.next(&record, &record_len);
 
-	// Read in records
-	while (getline(in_file, record)) {
+	// Append each record to the partition its key falls in: partition p
+	// holds the keys from splitter p - 1 (inclusive) to splitter p, so p is
+	// the number of splitters not greater than the key
+	while (in_file.next(&record, &record_len)) {
+		parse_record(record, record_len, schema, &slot[0]);
+		mk_key(schema, &slot[0], &key[0]);
+		int p = 0;
+		int hi = num_parts - 1;
+		while (p < hi) {
+			int mid = p + (hi - p) / 2;
+			if (memcmp(&splitters[mid * key_len], &key[0], key_len) <= 0) {
+				p = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		part_bufs[p]->append(&key[0], &slot[0]);
+		part_lengths[p]++;
+	}
 
-		// If we've completed a run, sort it and write it to the file
-		if ((record_idx != 0) && (record_idx % run_length == 0)) {
+	// Write out the last records of each partition
+	for (int p = 0; p < num_parts; p++) {
+		delete part_bufs[p];
+		close(part_fds[p]);
+	}
+}
 
-			// sort the records in this run
-			sort(run_records.begin(), run_records.end(), comp);
+long partition_capacity(long mem_capacity, Schema *schema, RunFormat format)
+{
+	// Besides the reader's block and the current record and its key, each
+	// partition needs an output buffer of at least a record, and a splitter
+	int key_len = key_length(schema);
+	long available = mem_capacity - budget_size(line_block_size() + format.stride + key_len, 4);
+	return max(0L, available / budget_size(format.stride + key_len, 1));
+}
 
-			// write the records to the output file
-			for (auto it = run_records.begin(); it != run_records.end(); it++) {
-				vector<string> cur_record = *it;
-				for (auto it2 = cur_record.begin(); it2 != cur_record.end(); it2++) {
-					out_file << *it2;
-				}
-				out_file << endl;
-			}
+long sort_capacity(long mem_capacity, Schema *schema, RunFormat format, RunFormat out_format)
+{
+	// Each record takes its place in memory, its place in the sorted output
+	// (or in a sorted chunk, laid out in `format`), a SlotEntry and, if keys
+	// are not stored, its built key
+	long record_cost = format.stride + max(format.stride, out_format.stride) + sizeof(SlotEntry) +
+	                   (format.key_len > 0 ? 0 : key_length(schema));
+	return max(0L, (mem_capacity - budget_size(0, 4)) / record_cost);
+}
+
+void sort_partition(char *filename, long length, long mem_capacity, RunFormat format,
+                    int out_fd, long out_pos, RunFormat out_format, RecordCompare rc,
+                    MergeEngine engine)
+{
+	int fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		cout << "could not open " << filename << " to sort partition" << endl;
+		exit(1);
+	}
+
+	// The number of records that can be sorted in memory at once
+	long capacity = max(1L, sort_capacity(mem_capacity, rc.schema, format, out_format));
+	long chunk_length = min(length, capacity);
+	char *records = budget_alloc(chunk_length * format.stride);
+
+	// If the partition fits, sort it in one go
+	if (length <= capacity) {
+		char *out = budget_alloc(length * out_format.stride);
+		pread_fully(fd, records, length * format.stride, 0);
+		sort_run(records, length, rc.schema, format, out_format, out);
+		pwrite_fully(out_fd, out, length * out_format.stride, out_pos);
+		budget_free(out);
+		budget_free(records);
+		close(fd);
+		return;
+	}
+
+	// Otherwise (the splitters were far off, or many records share a key),
+	// sort it a chunk at a time in place, and merge the sorted chunks with
+	// a buffer each. Chunk i is the run of the chunk_length records (fewer
+	// for the last) starting at record i * chunk_length.
+	int num_runs = (length + chunk_length - 1) / chunk_length;
+	auto chunk = [&] (int i) {
+		long start = i * chunk_length;
+		return Run {start * format.stride, min(chunk_length, length - start)};
+	};
+	char *out = budget_alloc(chunk_length * format.stride);
+	for (int i = 0; i < num_runs; i++) {
+		Run run = chunk(i);
+		pread_fully(fd, records, run.length * format.stride, run.start_pos);
+		sort_run(records, run.length, rc.schema, format, format, out);
+		pwrite_fully(fd, out, run.length * format.stride, run.start_pos);
+	}
+	budget_free(out);
+	budget_free(records);
+	close(fd);
+
+	long buf_size = (mem_capacity - merge_overhead(rc.schema, num_runs)) / (num_runs + 1);
+	if (buf_size < format.stride + 1 || buf_size < out_format.stride) {
+		cout << "not enough memory to merge partition " << filename << endl;
+		exit(1);
+	}
+	vector<RunIterator*> iters;
+	for (int i = 0; i < num_runs; i++) {
+		iters.push_back(new RunIterator(buf_size, rc.schema, format, false, NULL, NULL));
+		iters[i]->reset(filename, chunk(i).start_pos, chunk(i).length);
+	}
+	char *buf = budget_alloc(buf_size);
+	merge_runs(&iters[0], num_runs, out_fd, out_pos, buf_size, buf, rc, engine, NULL, out_format);
+	budget_free(buf);
+	for (int i = 0; i < num_runs; i++) {
+		delete iters[i];
+	}
+}
+
+long pread_fully(int fd, char *buf, long len, long pos)
+{
+	long bytes_read = 0;
+	while (bytes_read < len) {
+		ssize_t n = pread(fd, buf + bytes_read, len - bytes_read, pos + bytes_read);
+		if (n < 0) {
+			cout << "could not read from file descriptor " << fd << endl;
+			exit(1);
+		}
+		if (n == 0) {
+			break;
+		}
+		bytes_read += n;
+	}
+	return bytes_read;
+}
+
+void pwrite_fully(int fd, const char *buf, long len, long pos)
+{
+	for (long written = 0; written < len; ) {
+		ssize_t n = pwrite(fd, buf + written, len - written, pos + written);
+		if (n < 0) {
+			cout << "could not write to file descriptor " << fd << endl;
+			exit(1);
+		}
+		written += n;
+	}
+}
 
-			// clear the run vector, increment the number of runs
-			run_records.clear();
-			num_runs++;
+void copy_fully(int in_fd, long in_pos, int out_fd, long out_pos, long len, char *buf,
+                long buf_size)
+{
+	// Let the kernel copy as much as it can
+	while (len > 0) {
+		loff_t off_in = in_pos;
+		loff_t off_out = out_pos;
+		ssize_t n = copy_file_range(in_fd, &off_in, out_fd, &off_out, len, 0);
+		if (n <= 0) {
+			break;
 		}
+		in_pos += n;
+		out_pos += n;
+		len -= n;
+	}
 
-		// Read in the attributes of the record (strip trailing whitespace)
-		record = record.substr(0,record.size() - 1);
-		istringstream recordStream(record);
-		while (getline(recordStream, attribute, ',')) {
-			record_vect.push_back(attribute);
+	// Copy the rest a buffer at a time
+	while (len > 0) {
+		long n = pread_fully(in_fd, buf, min(len, buf_size), in_pos);
+		if (n <= 0) {
+			cout << "could not copy run" << endl;
+			exit(1);
 		}
+		pwrite_fully(out_fd, buf, n, out_pos);
+		in_pos += n;
+		out_pos += n;
+		len -= n;
+	}
+}
 
-		// Add the current record to the vector of all records for this run
-		run_records.push_back(record_vect);
-		record_vect.clear();
+IOThread::IOThread() {
+	this->stop = false;
+	this->worker = thread(&IOThread::run, this);
+}
 
-		// Increment the record number
-		record_idx++;
+IOThread::~IOThread() {
+	{
+		lock_guard<mutex> lock(this->mtx);
+		this->stop = true;
 	}
+	this->submitted.notify_one();
+	this->worker.join();
+}
 
-	// Sort and write any remaining records
-	sort(run_records.begin(), run_records.end(), comp);
-	for (auto it = run_records.begin(); it != run_records.end(); it++) {
-		vector<string> cur_record = *it;
-		for (auto it2 = cur_record.begin(); it2 != cur_record.end(); it2++) {
-			out_file << *it2;
+void IOThread::submit(IORequest *req) {
+	req->pending = true;
+	req->done = false;
+	{
+		lock_guard<mutex> lock(this->mtx);
+		this->queue.push_back(req);
+	}
+	this->submitted.notify_one();
+}
+
+void IOThread::wait(IORequest *req) {
+	if (!req->pending) {
+		return;
+	}
+	unique_lock<mutex> lock(this->mtx);
+	this->completed.wait(lock, [req] { return req->done; });
+	req->pending = false;
+}
+
+void IOThread::run() {
+	while (true) {
+		// Wait for a request (or for the thread to be stopped once the
+		// queue has drained)
+		unique_lock<mutex> lock(this->mtx);
+		this->submitted.wait(lock, [this] { return this->stop || !this->queue.empty(); });
+		if (this->queue.empty()) {
+			return;
+		}
+		IORequest *req = this->queue.front();
+		this->queue.pop_front();
+		lock.unlock();
+
+		// Requests are served in the order they were submitted
+		if (req->write) {
+			pwrite_fully(req->fd, req->buf, req->len, req->pos);
+			req->result = req->len;
+		} else {
+			req->result = pread_fully(req->fd, req->buf, req->len, req->pos);
 		}
-		out_file << endl;
+
+		lock.lock();
+		req->done = true;
+		this->completed.notify_all();
 	}
+}
+
+OutputBuffer::OutputBuffer(int fd, long pos, RunFormat format, char *buf, long buf_size,
+                           IOThread *io) {
+	this->fd = fd;
+	this->format = format;
+	this->record_len = format.stride - format.key_len - (format.newline ? 1 : 0);
+	this->owned = buf == NULL;
+	this->buf = this->owned ? budget_alloc(buf_size) : buf;
 
-	if (!run_records.empty()) {
-		num_runs++;
+	// Double buffer only if each half still holds a record
+	this->io = buf_size / 2 < format.stride ? NULL : io;
+	long half_size = this->io != NULL ? buf_size / 2 : buf_size;
+	this->halves[0] = this->buf;
+	this->halves[1] = this->buf + half_size;
+	this->cur_half = 0;
+	this->capacity = max(1L, half_size / format.stride);
+	this->count = 0;
+	this->out_pos = pos;
+	this->writes[0].pending = this->writes[1].pending = false;
+}
+
+OutputBuffer::~OutputBuffer() {
+	this->finish();
+	if (this->owned) {
+		budget_free(this->buf);
 	}
+}
 
-	// Close streams
-	in_file.close();
-	out_file.close();
+void OutputBuffer::flush() {
+	long len = this->count * this->format.stride;
+	if (this->io == NULL) {
+		pwrite_fully(this->fd, this->buf, len, this->out_pos);
+	} else if (len > 0) {
+		// Hand the write off, and continue in the other half once that
+		// half's own previous write has completed
+		IORequest *req = &this->writes[this->cur_half];
+		req->write = true;
+		req->fd = this->fd;
+		req->buf = this->halves[this->cur_half];
+		req->len = len;
+		req->pos = this->out_pos;
+		this->io->submit(req);
+		this->cur_half = 1 - this->cur_half;
+		this->io->wait(&this->writes[this->cur_half]);
+	}
+	this->out_pos += len;
+	this->count = 0;
+}
 
-	return num_runs;
+void OutputBuffer::finish() {
+	this->flush();
+	if (this->io != NULL) {
+		this->io->wait(&this->writes[0]);
+		this->io->wait(&this->writes[1]);
+	}
 }
 
-void merge_runs(RunIterator* iterators[], int num_runs, char *out_filename,
-                long start_pos, long buf_size, char* buf, RecordCompare rc)
+long merge_overhead(Schema *schema, int fan_in)
 {
-	// Open the file for writing
-	ofstream out;
-	if (start_pos == 0) {
-		out = ofstream(out_filename);
-	} else {
-		out = ofstream(out_filename, ios::app);
-	}
+	// The key slots, and the loser tree's leaves, nodes and winners (the
+	// priority queue's storage is no larger); each of those blocks and the
+	// fan_in + 1 buffers may be rounded up to the budget's alignment
+	long per_run = key_length(schema) + sizeof(BufRecord) + 3 * sizeof(int);
+	return budget_size(fan_in * per_run, fan_in + 5);
+}
 
-	// Open the output file for writing (appending)
-	if (!out.is_open()) {
-		cerr << "Unable to open output file for merging runs" << endl;
-		exit(1);
+void merge_runs(RunIterator* iterators[], int num_runs, int out_fd,
+                long start_pos, long buf_size, char* buf, RecordCompare rc,
+                MergeEngine engine, IOThread *io, RunFormat out_format)
+{
+	// Whether the input runs store each record's key before the record
+	bool keys_stored = num_runs > 0 && iterators[0]->format.key_len > 0;
+
+	// One normalized key slot per input buffer, for runs that do not store
+	// keys. A buffer's slot is only overwritten after its previous record
+	// has left the queue (or tree).
+	unsigned char *keys = (unsigned char*) budget_alloc(num_runs * rc.key_len);
+
+	// Lambda for advancing the iterator for buffer `buf_idx` into `record`.
+	// The record's key is read from the run if stored there; otherwise it is
+	// built in the buffer's key slot, if `need_key` is set. Returns false if
+	// the run is exhausted.
+	auto next_record = [&] (int buf_idx, BufRecord& record, bool need_key) {
+		if (!iterators[buf_idx]->has_next()) {
+			return false;
+		}
+		record.data = iterators[buf_idx]->next();
+		record.buf_idx = buf_idx;
+		if (keys_stored) {
+			record.key = iterators[buf_idx]->cur_key;
+		} else if (need_key) {
+			record.key = &keys[buf_idx * rc.key_len];
+			rc.key(record.data, record.key);
+		}
+		record.prefix = need_key ? key_prefix(record.key, rc.key_len) : 0;
+		return true;
+	};
+
+	// If there's exactly one run to be merged and it is already laid out
+	// like the output, copy it to the output file without looking at it
+	RunFormat in_format = num_runs > 0 ? iterators[0]->format : out_format;
+	if (num_runs == 1 && in_format.key_len == out_format.key_len &&
+		in_format.newline == out_format.newline) {
+		RunIterator *it = iterators[0];
+		long len = it->run_length * out_format.stride;
+		copy_fully(it->fd, it->start_pos, out_fd, start_pos, len, buf, buf_size);
+		it->record_idx = it->run_length;
+		it->release(it->start_pos + len);
+		budget_free(keys);
+		return;
 	}
 
-	// If there's exactly one run to be merged, just write it directly
-	// to the output file, since it's already sorted
+	// The output buffer. Records (and their keys, if the output format
+	// stores them) are copied into it exactly as they will be laid out in
+	// the file; whenever it is full, it is written out.
+	OutputBuffer out(out_fd, start_pos, out_format, buf, buf_size, io);
+
+	// Otherwise a single run is just written directly to the output file,
+	// since it's already sorted (keys are only needed if the output stores
+	// them)
 	if (num_runs == 1) {
-		while (iterators[0]->has_next()) {
-			out << iterators[0]->next() << endl;
+		BufRecord record = {};
+		while (next_record(0, record, out_format.key_len > 0)) {
+			out.append(record.key, record.data);
 		}
-		out.close();
+		out.finish();
+		budget_free(keys);
 		return;
 	}
 
-	// The number of records that can be stored in the buffer
-	long buf_record_capacity = iterators[0]->buf_record_capacity;
+	if (engine == MERGE_LOSER_TREE) {
 
-	// Zero out the output buffer
-	memset(buf,0,buf_size);
+		// Initialize the tree with the first record in each buffer
+		LoserTree tree(num_runs, rc);
+		for (int i = 0; i < num_runs; i++) {
+			if (!next_record(i, tree.leaves[i], true)) {
+				tree.leaves[i].data = NULL;
+			}
+		}
+		tree.build();
 
-	// Initialize priority queue for k-way merge
-	BufRecordCompare brc {rc};
-	MergePriorityQueue pq(brc);
+		// Continue merging records until every run is exhausted
+		while (!tree.empty()) {
 
-	// Initialize priority queue with the first record in each buffer
-	BufRecord cur_record;
-	for (int i = 0; i < num_runs; i++) {
-		cur_record.data = iterators[i]->next();
-		cur_record.buf_idx = i;
-		pq.push(cur_record);
+			// Copy the winner into the output buffer, replace it with the next
+			// record from its buffer, and replay its matches
+			int winner = tree.winner();
+			out.append(tree.leaves[winner].key, tree.leaves[winner].data);
+			if (!next_record(winner, tree.leaves[winner], true)) {
+				tree.leaves[winner].data = NULL;
+			}
+			tree.replay(winner);
+		}
+	} else {
+
+		// Initialize priority queue for k-way merge, with room for a record
+		// from every buffer
+		BufRecordCompare brc {rc};
+		BudgetVector<BufRecord> pq_storage;
+		pq_storage.reserve(num_runs);
+		MergePriorityQueue pq(brc, move(pq_storage));
+
+		// Initialize priority queue with the first record in each buffer
+		BufRecord cur_record;
+		for (int i = 0; i < num_runs; i++) {
+			if (next_record(i, cur_record, true)) {
+				pq.push(cur_record);
+			}
+		}
+
+		// Continue merging records until there are no more
+		while (!pq.empty()) {
+
+			// Pop the next record from the top of the priority queue
+			// and copy it into the output buffer
+			cur_record = pq.top();
+			pq.pop();
+			out.append(cur_record.key, cur_record.data);
+
+			// Check the buffer that this record came from to see whether
+			// it contains any more records. If it does, increment the
+			// iterator for that buffer and add the next record to the queue
+			if (next_record(cur_record.buf_idx, cur_record, true)) {
+				pq.push(cur_record);
+			}
+		}
+	}
+
+	// Flush any records remaining in the buffer
+	out.finish();
+
+	// Free the key slots
+	budget_free(keys);
+}
+
+vector<MergePass> plan_merge(long num_runs, int k)
+{
+	vector<MergePass> plan;
+
+	// The number of runs the passes after the first can merge completely:
+	// the smallest power of k that is at least num_runs, divided by k
+	long full = 1;
+	while (full * k < num_runs) {
+		full *= k;
+	}
+
+	// If there are more runs than that, the first pass merges just enough of
+	// them (in groups of k, plus one smaller group) to leave `full` runs
+	long runs = num_runs;
+	if (runs > k && runs > full) {
+		long excess = runs - full;
+		long groups = excess / (k - 1);
+		long rest = excess % (k - 1);
+		MergePass pass;
+		pass.num_runs = runs;
+		pass.runs_merged = groups * k + (rest > 0 ? rest + 1 : 0);
+		pass.fan_in = groups > 0 ? k : rest + 1;
+		pass.runs_out = full;
+		plan.push_back(pass);
+		runs = full;
 	}
 
-	// Stores the next record to be added to the priority queue
-	BufRecord next_record;
+	// Then every pass merges all of its runs, k at a time
+	do {
+		MergePass pass;
+		pass.num_runs = runs;
+		pass.runs_merged = runs;
+		pass.fan_in = max(1L, min((long) k, runs));
+		pass.runs_out = (runs + k - 1) / k;
+		plan.push_back(pass);
+		runs = pass.runs_out;
+	} while (runs > 1);
+
+	return plan;
+}
+
+long run_list_size(long num_runs, int k, int num_threads)
+{
+	// The runs, the runs a pass merges them into (at most one per two runs,
+	// or one per thread for a partitioned merge), and the sections of a
+	// partitioned merge's runs
+	long merged = max((num_runs + 1) / 2, (long) num_threads);
+	long sections = num_threads > 1 ? (long) num_threads * k : 0;
+	return budget_size((num_runs + merged + sections) * sizeof(Run), 3);
+}
+
+void partition_runs(char *filename, const Run *runs, int num_runs, RunFormat format,
+                    RecordCompare rc, int num_parts, long mem_capacity,
+                    BudgetVector<Run> &sections)
+{
+	// The most keys sampled from each run per part
+	const long SAMPLES_PER_PART = 32;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		cout << "could not open " << filename << " for partitioning runs" << endl;
+		exit(1);
+	}
 
-	// The number of records currently stored in the buffer
-	int records_in_buf = 0;
+	long stride = format.stride;
+	int key_len = rc.key_len;
+	char *entry = budget_alloc(stride);
+	BudgetVector<char> key(key_len);
 
-	// Continue merging records until there are no more
-	while (!pq.empty()) {
+	// The first record of each run in each key range, and the end of each
+	// run: bounds[p * num_runs + j] for key range p and run j. Key range p
+	// starts at the first record not less than splitter p.
+	BudgetVector<long> bounds((num_parts + 1) * num_runs, 0);
+	for (int j = 0; j < num_runs; j++) {
+		bounds[num_parts * num_runs + j] = runs[j].length;
+	}
 
-		// Pop the next record from the top of the priority queue
-		BufRecord cur_record = pq.top();
-		pq.pop();
+	// Lambda for reading the normalized key of record `idx` of `run` into
+	// `dst`, from the run if stored there, otherwise by building it from the
+	// record
+	auto read_key = [&] (const Run& run, long idx, char *dst) {
+		pread_fully(fd, entry, stride, run.start_pos + idx * stride);
+		if (format.key_len > 0) {
+			memcpy(dst, entry, key_len);
+		} else {
+			rc.key(entry, (unsigned char*) dst);
+		}
+	};
 
-		// Copy it into the output buffer
-		strcat(buf, cur_record.data);
-		records_in_buf++;
+	// Sample keys spread evenly through every run, as many per part as fit
+	// in the memory left (each is sorted into a second copy, through a
+	// SlotEntry), and sort them
+	long sample_cost = 2 * key_len + sizeof(SlotEntry);
+	long available = mem_capacity - budget_size(stride + key_len + bounds.size() * sizeof(long), 6);
+	long samples_per_part = max(1L, min(SAMPLES_PER_PART,
+	                                    available / (sample_cost * num_parts * max(1, num_runs))));
+	BudgetVector<char> samples;
+	samples.reserve(num_runs * samples_per_part * num_parts * key_len);
+	long num_samples = 0;
+	for (int j = 0; j < num_runs; j++) {
+		long run_samples = min(runs[j].length, samples_per_part * num_parts);
+		for (long i = 0; i < run_samples; i++) {
+			samples.resize((num_samples + 1) * key_len);
+			read_key(runs[j], (2 * i + 1) * runs[j].length / (2 * run_samples),
+			         &samples[num_samples * key_len]);
+			num_samples++;
+		}
+	}
+	if (num_samples > 0) {
+		BudgetVector<char> sorted(samples.size());
+		sort_run(&samples[0], num_samples, rc.schema, key_format(rc.schema),
+		         key_format(rc.schema), &sorted[0]);
+		samples.swap(sorted);
+	}
 
-		// If the output buffer is full (or nearly so), flush it to disk and clear the buffer
-		if (records_in_buf == buf_record_capacity) {
-			string s = string(buf);
-			int record_len = strlen(cur_record.data);
-			for (int i = 0; i < records_in_buf; i++) {
-				out << s.substr(i * record_len, record_len) << endl;
+	// Binary-search every run for each splitter
+	for (int p = 1; p < num_parts && num_samples > 0; p++) {
+		const char *splitter = &samples[p * num_samples / num_parts * key_len];
+		for (int j = 0; j < num_runs; j++) {
+			long lo = bounds[(p - 1) * num_runs + j];
+			long hi = runs[j].length;
+			while (lo < hi) {
+				long mid = lo + (hi - lo) / 2;
+				read_key(runs[j], mid, &key[0]);
+				if (memcmp(&key[0], splitter, key_len) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
 			}
-			memset(buf,0,buf_size);
-			records_in_buf = 0;
+			bounds[p * num_runs + j] = lo;
 		}
+	}
 
-		// Check the buffer that this record came from to see whether
-		// it contains any more records. If it does, increment the
-		// iterator for that buffer and add the next record to the queue
-		if (iterators[cur_record.buf_idx]->has_next()) {
-			next_record.data = iterators[cur_record.buf_idx]->next();
-			next_record.buf_idx = cur_record.buf_idx;
-			pq.push(next_record);
+	// Cut every run at the bounds
+	sections.clear();
+	for (int p = 0; p < num_parts; p++) {
+		for (int j = 0; j < num_runs; j++) {
+			long first = bounds[p * num_runs + j];
+			long last = bounds[(p + 1) * num_runs + j];
+			sections.push_back(Run {runs[j].start_pos + first * stride, last - first});
 		}
 	}
 
-	// Flush any records remaining in the buffer
-	if (records_in_buf > 0) {
-		string s = string(buf);
-		int record_len = strlen(cur_record.data);
-		for (int i = 0; i < records_in_buf; i++) {
-			out << s.substr(i * record_len, record_len) << endl;
+	budget_free(entry);
+	close(fd);
+}
+
+LoserTree::LoserTree(int k, RecordCompare rc) {
+	this->k = k;
+	this->rc = rc;
+	this->leaves = (BufRecord*) budget_alloc(k * sizeof(BufRecord));
+	this->tree = (int*) budget_alloc((k > 1 ? k : 1) * sizeof(int));
+}
+
+LoserTree::~LoserTree() {
+	budget_free(this->leaves);
+	budget_free(this->tree);
+}
+
+bool LoserTree::less(int i, int j) const {
+	// Exhausted inputs lose every match
+	if (this->leaves[i].data == NULL) {
+		return false;
+	}
+	if (this->leaves[j].data == NULL) {
+		return true;
+	}
+	if (this->leaves[i].prefix != this->leaves[j].prefix) {
+		return this->leaves[i].prefix < this->leaves[j].prefix;
+	}
+	return this->rc.key_len > 8 && this->rc(this->leaves[i].key, this->leaves[j].key);
+}
+
+void LoserTree::build() {
+	if (this->k == 1) {
+		this->tree[0] = 0;
+		return;
+	}
+
+	// Play the tournament bottom-up. Node n's children are nodes 2n and
+	// 2n+1, and input i sits at node k+i, so this works for any k.
+	// winners[n] is the input that won at node n.
+	BudgetVector<int> winners(2 * this->k);
+	for (int i = 0; i < this->k; i++) {
+		winners[this->k + i] = i;
+	}
+	for (int n = this->k - 1; n >= 1; n--) {
+		int left = winners[2 * n];
+		int right = winners[2 * n + 1];
+		if (this->less(right, left)) {
+			winners[n] = right;
+			this->tree[n] = left;
+		} else {
+			winners[n] = left;
+			this->tree[n] = right;
 		}
-		memset(buf,0,buf_size);
-		records_in_buf = 0;
 	}
+	this->tree[0] = winners[1];
+}
+
+void LoserTree::replay(int i) {
+	// Walk from input i's leaf to the root. At each node the stored loser
+	// plays the current winner, and whichever loses stays behind.
+	int winner = i;
+	for (int n = (this->k + i) / 2; n >= 1; n /= 2) {
+		if (this->less(this->tree[n], winner)) {
+			swap(this->tree[n], winner);
+		}
+	}
+	this->tree[0] = winner;
+}
+
+RunStore::RunStore(char *filename) {
+	this->filename = filename;
+	this->fd = open(filename, O_RDWR);
+	struct stat st;
+	if (this->fd < 0 || fstat(this->fd, &st) < 0) {
+		cout << "could not open " << filename << " to store runs" << endl;
+		exit(1);
+	}
+	this->end = st.st_size;
+	this->block_size = st.st_blksize > 0 ? st.st_blksize : 4096;
+}
+
+RunStore::~RunStore() {
+	close(this->fd);
+	unlink(this->filename);
+}
+
+long RunStore::allocate(long len) {
+	lock_guard<mutex> lock(this->mtx);
+	long pos = this->end;
+	this->end += len;
+	return pos;
+}
+
+void RunStore::release(long pos, long len) {
+	if (len <= 0) {
+		return;
+	}
+	lock_guard<mutex> lock(this->mtx);
+
+	// Merge the extent with any free extents it touches
+	long start = pos;
+	long stop = pos + len;
+	auto it = this->free_extents.upper_bound(start);
+	if (it != this->free_extents.begin() && prev(it)->second >= start) {
+		it--;
+		start = it->first;
+		stop = max(stop, it->second);
+		it = this->free_extents.erase(it);
+	}
+	while (it != this->free_extents.end() && it->first <= stop) {
+		stop = max(stop, it->second);
+		it = this->free_extents.erase(it);
+	}
+	this->free_extents[start] = stop;
 
-	// Close the output file and ree the output buffer
-	out.close();
+	// Give back the whole blocks in the merged extent. Punching a hole only
+	// deallocates them; the file keeps its size. If the file system cannot
+	// punch holes, the space is simply kept until the file is removed.
+	long first_block = (start + this->block_size - 1) / this->block_size * this->block_size;
+	long last_block = stop / this->block_size * this->block_size;
+	if (last_block > first_block) {
+		fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first_block,
+		          last_block - first_block);
+	}
 }
 
-RunIterator::RunIterator(long buf_size, Schema *schema) {
+RunIterator::RunIterator(long buf_size, Schema *schema, RunFormat format, bool use_mmap,
+                         IOThread *io, RunStore *store) {
 	this->buf_size = buf_size;
-	this->buf = new char[buf_size];
 	this->schema = schema;
-	this->buf_record_capacity = this->buf_size / (this->schema->total_record_length + 1);
-	this->cur_record = new char[this->schema->total_record_length + 1];
+	this->format = format;
+	this->use_mmap = use_mmap;
+	this->map = NULL;
+	this->map_len = 0;
+	this->fd = -1;
+	this->filename = NULL;
+	this->io = use_mmap || buf_size / 2 < format.stride ? NULL : io;
+	this->prefetch.pending = false;
+	this->store = store;
+	this->released_pos = 0;
+
+	// With an I/O thread, the buffer is split into two halves: the records
+	// in one half are consumed while the next section of the run is read
+	// into the other
+	long section_size = this->io != NULL ? buf_size / 2 : buf_size;
+	this->buf_record_capacity = section_size / format.stride;
+
+	// A memory-mapped run is read in place, so it needs no buffer
+	this->buf_alloc = use_mmap ? NULL : budget_alloc(buf_size);
+	this->buf = this->buf_alloc;
+	this->prefetch_buf = this->io != NULL ? this->buf_alloc + section_size : NULL;
 }
 
 void RunIterator::reset(char *filename, long start_pos, long run_length) {
+	// Any prefetch of the previous run is no longer needed, but its
+	// buffer half must not be reused until the read completes
+	if (this->io != NULL) {
+		this->io->wait(&this->prefetch);
+	}
+
+	// Keep the file open across runs; only reopen when the pass changes files
+	if (this->fd < 0 || strcmp(this->filename, filename) != 0) {
+		if (this->fd >= 0) {
+			close(this->fd);
+		}
+		this->fd = open(filename, O_RDONLY);
+		if (this->fd < 0) {
+			cout << "could not open " << filename << " for creation of run iterator" << endl;
+			exit(1);
+		}
+	}
+
 	this->filename = filename;
 	this->start_pos = start_pos;
 	this->run_length = run_length;
-	this->next_section_pos = start_pos + ((schema->total_record_length + 1) * this->buf_record_capacity);
+	this->next_section_pos = start_pos;
+	this->released_pos = start_pos;
 	this->record_idx = 0;
 	this->buf_record_idx = 0;
 
-	// clear the buffer and current record
-	memset(this->buf, 0, this->buf_size);
-	memset(this->cur_record, 0, this->schema->total_record_length + 1);
+	if (this->use_mmap) {
+		this->map_run();
+	} else {
+		this->fill_buffer();
+	}
+}
+
+void RunIterator::fill_buffer() {
+	long stride = this->format.stride;
 
-	// Open the file for reading
-	ifstream in_file(filename);
-	if (!in_file.is_open()) {
-		cout << "could not open " << filename << " for creation of run iterator" << endl;
-		exit(1);
+	// The section in the buffer has been read
+	this->release(this->next_section_pos);
+
+	// Read the next section of the run (at most a buffer's worth) with a
+	// single pread. The file holds records exactly as the buffer does, so
+	// nothing needs to be parsed. If the section was prefetched, just wait
+	// for that read and make its half of the buffer the current one.
+	long remaining = this->run_length - this->record_idx;
+	long len = (remaining < this->buf_record_capacity ? remaining : this->buf_record_capacity) * stride;
+	long bytes_read;
+	if (this->prefetch.pending) {
+		this->io->wait(&this->prefetch);
+		bytes_read = this->prefetch.result;
+		swap(this->buf, this->prefetch_buf);
+	} else {
+		bytes_read = pread_fully(this->fd, this->buf, len, this->next_section_pos);
+	}
+
+	// If the file ended early, the current run is shorter than we
+	// previously thought, so we update it
+	if (bytes_read < len) {
+		this->run_length = this->record_idx + bytes_read / stride;
+	}
+
+	// Update next_section_pos and reset buf_record_idx
+	this->next_section_pos += bytes_read;
+	this->buf_record_idx = 0;
+
+	// Start reading the section after this one into the other half
+	remaining = this->run_length - this->record_idx - bytes_read / stride;
+	if (this->io != NULL && remaining > 0) {
+		this->prefetch.write = false;
+		this->prefetch.fd = this->fd;
+		this->prefetch.buf = this->prefetch_buf;
+		this->prefetch.len = (remaining < this->buf_record_capacity ? remaining : this->buf_record_capacity) * stride;
+		this->prefetch.pos = this->next_section_pos;
+		this->io->submit(&this->prefetch);
 	}
+}
 
-	// Set the start position within the file. We assume that
-	// the start position lands us at the beginning of a record.
-	in_file.seekg(start_pos);
+void RunIterator::map_run() {
+	// Unmap the previous run
+	if (this->map != NULL) {
+		munmap(this->map, this->map_len);
+		this->map = NULL;
+		this->map_len = 0;
+	}
 
-	// Read records one by one into the buffer
-	string record;
-	int i = 0;
-	while (getline(in_file, record) && i < this->buf_record_capacity) {
-		strncat(buf, record.c_str(), record.size());
-		i++;
+	struct stat st;
+	if (fstat(this->fd, &st) < 0) {
+		cout << "could not open " << this->filename << " for creation of run iterator" << endl;
+		exit(1);
 	}
 
-	// If i is ever less than the buf_record_capacity, it means the current
-	// run length is less than we previously thought, so we update it
-	if (i < this->buf_record_capacity) {
-		this->run_length = i;
-	} else {
-		this->run_length = run_length;
+	// The run cannot extend past the end of the file
+	long stride = this->format.stride;
+	long available = (st.st_size - this->start_pos) / stride;
+	if (available < this->run_length) {
+		this->run_length = available > 0 ? available : 0;
+	}
+
+	if (this->run_length > 0) {
+		// Mappings must start on a page boundary
+		long page_size = sysconf(_SC_PAGESIZE);
+		long map_start = this->start_pos - (this->start_pos % page_size);
+		this->map_len = this->start_pos - map_start + this->run_length * stride;
+		this->map = (char*) mmap(NULL, this->map_len, PROT_READ, MAP_PRIVATE, this->fd, map_start);
+		if (this->map == MAP_FAILED) {
+			cout << "could not map " << this->filename << " for creation of run iterator" << endl;
+			exit(1);
+		}
+
+		// The run is read front to back exactly once, so ask the kernel
+		// to read ahead aggressively and drop pages behind us
+		madvise(this->map, this->map_len, MADV_SEQUENTIAL);
+		this->run_data = this->map + (this->start_pos - map_start);
 	}
+}
 
-	// Close the stream for reading
-	in_file.close();
+void RunIterator::release(long pos) {
+	if (this->store != NULL && pos > this->released_pos) {
+		this->store->release(this->released_pos, pos - this->released_pos);
+		this->released_pos = pos;
+	}
 }
 
 RunIterator::~RunIterator() {
-	free(this->buf);
-	free(this->cur_record);
+	if (this->io != NULL) {
+		this->io->wait(&this->prefetch);
+	}
+	if (this->map != NULL) {
+		munmap(this->map, this->map_len);
+	}
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+	budget_free(this->buf_alloc);
 }
 
 char* RunIterator::next() {
 
-	// Copy record from buffer
-	int record_len = this->schema->total_record_length;
-	strncpy(this->cur_record, &this->buf[buf_record_idx * record_len], record_len);
+	// A mapped run is read in place. The record is not null-terminated.
+	if (this->use_mmap) {
+		char *entry = this->run_data + this->record_idx * this->format.stride;
+		this->cur_key = (unsigned char*) entry;
+		this->record_idx++;
+		return entry + this->format.key_len;
+	}
 
-	// Shouldn't have to explicitly null-terminate,
-	// but didn't take the time to figure a way around it
-	this->cur_record[record_len] = '\0';
+	// The record (and its key, if stored before it) is used in place in the
+	// buffer; the merge copies it once, into its output buffer
+	char *entry = &this->buf[buf_record_idx * this->format.stride];
+	this->cur_key = (unsigned char*) entry;
 
 	// Increment iterator index
 	this->record_idx++;
 	this->buf_record_idx++;
 
 	// Return record
-	return this->cur_record;
+	return entry + this->format.key_len;
 }
 
 bool RunIterator::has_next() {
 	// If we've reached the end of the buffer, we need to attempt to
 	// load in the next records in the run from disk
-	if (this->buf_record_idx == this->buf_record_capacity && 
+	if (!this->use_mmap && this->buf_record_idx == this->buf_record_capacity &&
 		this->record_idx < this->run_length) {
-
-		// Open the file for reading
-		ifstream in_file(filename);
-		if (!in_file.is_open()) {
-			cout << "could not open " << filename << "for iterating over runs" << endl;
-			exit(1);
-		}
-
-		// Determine the start position of the next section of the run
-		in_file.seekg(next_section_pos);
-
-		// Zero out the buffer for good measure
-		memset(buf,0,buf_size);
-
-		// Read records one by one into the buffer
-		string record;
-		int i = 0;
-		while (getline(in_file, record) && i < this->buf_record_capacity) {
-			strncat(buf, record.c_str(), record.size());
-			i++;
-		}
-
-		// If i is ever less than the buf_record_capacity, it means the current
-		// run length is less than we previously thought, so we update it
-		if (i < this->buf_record_capacity) {
-			this->run_length = this->record_idx + i;
-		}
-
-		// Close the stream
-		in_file.close();
-
-		// Update next_section_pos and reset buf_record_idx
-		this->next_section_pos += ((schema->total_record_length + 1) * this->buf_record_capacity);
-		this->buf_record_idx = 0;
+		this->fill_buffer();
 	}
-	return this->record_idx < this->run_length;
+	if (this->record_idx < this->run_length) {
+		return true;
+	}
+
+	// The whole run has been read
+	this->release(this->start_pos + this->run_length * this->format.stride);
+	return false;
 }
\ No newline at end of file
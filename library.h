@@ -11,12 +11,19 @@
 #include <cassert>
 #include <cmath>
 #include <cstring>
+#include <cstdint>
+#include <iomanip>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
 // Named constants for numerical attribute types
-static const char* INTEGER = "integer";
-static const char* FLOAT = "float";
+static const char* const INTEGER = "integer";
+static const char* const FLOAT = "float";
 
 /**
  * The attribute schema
@@ -43,58 +50,582 @@ typedef struct {
 } Schema;
 
 /**
- * Stores a record, along with the index of the input buffer
- * that it came from
+ * Parses a fixed-width numeric attribute in place. Unlike atof, the field
+ * does not need to be null-terminated and nothing is allocated. Leading
+ * and trailing spaces are ignored.
+ */
+inline double parse_numeric(const char* field, int len) {
+  int i = 0;
+  while (i < len && field[i] == ' ') i++;
+
+  // Optional sign
+  bool negative = false;
+  if (i < len && (field[i] == '-' || field[i] == '+')) {
+    negative = field[i] == '-';
+    i++;
+  }
+
+  // Accumulate all digits as an integer mantissa, remembering how many
+  // came after the decimal point, so that a single division at the end
+  // gives the correctly rounded value (the same one atof would produce)
+  double mantissa = 0;
+  double scale = 1;
+  bool seen_point = false;
+  for (; i < len; i++) {
+    char c = field[i];
+    if (c >= '0' && c <= '9') {
+      mantissa = mantissa * 10 + (c - '0');
+      if (seen_point) scale *= 10;
+    } else if (c == '.' && !seen_point) {
+      seen_point = true;
+    } else {
+      break;
+    }
+  }
+  double value = mantissa / scale;
+  return negative ? -value : value;
+}
+
+/**
+ * Parses a fixed-width integer attribute in place (see parse_numeric)
+ */
+inline int64_t parse_integer(const char* field, int len) {
+  int i = 0;
+  while (i < len && field[i] == ' ') i++;
+  bool negative = false;
+  if (i < len && (field[i] == '-' || field[i] == '+')) {
+    negative = field[i] == '-';
+    i++;
+  }
+  int64_t value = 0;
+  for (; i < len && field[i] >= '0' && field[i] <= '9'; i++) {
+    value = value * 10 + (field[i] - '0');
+  }
+  return negative ? -value : value;
+}
+
+/**
+ * Returns the first 8 bytes of a normalized key as a big-endian integer
+ * (zero-padded if the key is shorter), so that comparing prefixes as
+ * integers agrees with comparing the keys with memcmp.
+ */
+inline uint64_t key_prefix(const unsigned char* key, int key_len) {
+  uint64_t prefix = 0;
+  int n = key_len < 8 ? key_len : 8;
+  for (int i = 0; i < n; i++) {
+    prefix |= (uint64_t) key[i] << (56 - 8 * i);
+  }
+  return prefix;
+}
+
+/**
+ * Returns the length in bytes of the normalized sort key for the
+ * schema's sorting attributes. Numeric attributes take 8 bytes and
+ * string attributes take their schema length.
+ */
+int key_length(Schema *schema);
+
+/**
+ * Writes the order-preserving binary encoding of a single attribute value,
+ * starting at `field`, to `key`. Integers and floats are encoded big-endian
+ * with their sign bits flipped, so that memcmp orders them numerically;
+ * strings are copied and zero-padded to their schema length. Returns the
+ * number of bytes written.
+ */
+int encode_attr(Attribute *attr, const char* field, unsigned char* key);
+
+/**
+ * Builds the normalized key of a fixed-width record: the encodings of its
+ * sorting attributes, in priority order. Normalized keys compare with
+ * memcmp in the same order as the records they were built from.
+ */
+void mk_key(Schema *schema, const char* record, unsigned char* key);
+
+// Every block carved out of a MemoryBudget starts on this boundary
+static const long BUDGET_ALIGN = 16;
+
+/**
+ * The memory a sort may use: a single arena of `capacity` bytes, allocated
+ * up front, out of which every buffer is carved (first fit, with freed
+ * blocks merged back together). The peak number of bytes in use is
+ * recorded, so that it can be reported.
+ */
+class MemoryBudget {
+
+public:
+
+  MemoryBudget(long capacity);
+
+  ~MemoryBudget();
+
+  /**
+   * allocates `bytes` (rounded up to BUDGET_ALIGN) from the arena. Returns
+   * NULL if no free block is large enough.
+   */
+  char* allocate(long bytes);
+
+  /**
+   * returns a block allocated by `allocate` to the arena
+   */
+  void release(char *ptr);
+
+  // The size of the arena, and the bytes currently and at most in use
+  long capacity;
+  long used;
+  long peak;
+
+private:
+
+  mutex mtx;
+  char *arena;
+
+  // The free blocks and the allocated blocks, by offset, and their sizes
+  map<long, long> free_blocks;
+  map<long, long> blocks;
+};
+
+/**
+ * Makes `budget` the arena that budget_alloc allocates from. With no
+ * budget (the default), budget_alloc allocates from the heap.
+ */
+void set_memory_budget(MemoryBudget *budget);
+
+/**
+ * Returns the current memory budget, or NULL if there is none
+ */
+MemoryBudget* memory_budget();
+
+/**
+ * Allocates `bytes` from the memory budget (or the heap). Running out of
+ * budget stops the sort with an error, rather than exceeding it.
+ */
+char* budget_alloc(long bytes);
+
+/**
+ * Frees a block allocated by budget_alloc
+ */
+void budget_free(void *ptr);
+
+/**
+ * Returns the number of bytes taken from the budget by `count` blocks
+ * adding up to `bytes`, allowing for each block's alignment
+ */
+inline long budget_size(long bytes, long count) {
+  return bytes + count * BUDGET_ALIGN;
+}
+
+/**
+ * STL allocator drawing from the memory budget, so that containers
+ * holding records or keys count against it
+ */
+template <typename T>
+struct BudgetAllocator {
+  typedef T value_type;
+
+  BudgetAllocator() {}
+  template <typename U> BudgetAllocator(const BudgetAllocator<U>&) {}
+
+  T* allocate(size_t n) { return (T*) budget_alloc(n * sizeof(T)); }
+  void deallocate(T* p, size_t) { budget_free(p); }
+
+  template <typename U> bool operator==(const BudgetAllocator<U>&) const { return true; }
+  template <typename U> bool operator!=(const BudgetAllocator<U>&) const { return false; }
+};
+
+/**
+ * A vector whose storage counts against the memory budget
+ */
+template <typename T>
+using BudgetVector = vector<T, BudgetAllocator<T> >;
+
+/**
+ * Refers to a record in place in the input buffer (or mapping) it came
+ * from, along with the index of that buffer. The record is not copied
+ * until it is written to the output buffer.
  */
 typedef struct {
   char* data;
   int buf_idx;
+
+  // The record's normalized key, built once when the record enters
+  // the merge, and its first 8 bytes as an integer
+  unsigned char* key;
+  uint64_t prefix;
 } BufRecord;
 
 /**
- * Function object for comparing two records
+ * Function object for comparing records by their normalized keys
  */
 typedef struct {
 
-  // The byte offset of the sorting attribute within the string
-  int offset;
+  // The record schema (the key is built from its sorting attributes)
+  Schema *schema;
 
-  // The length of the sorting attribute
-  int attr_len;
+  // The length of a normalized key
+  int key_len;
 
-  // Whether the sorting attribute is numeric
-  bool is_numeric;
+  // Builds the normalized key of a record
+  void key(const char* record, unsigned char* key) const { mk_key(schema, record, key); }
 
-  // The comparison operator. Handles both string and numerical attributes.
-  bool operator() (char* r1, char* r2) {
-    string s1(r1);
-    string s1_sort_attr = s1.substr(offset, attr_len);
-    string s2(r2);
-    string s2_sort_attr = s2.substr(offset, attr_len);
-    if (is_numeric) {
-      return atof(s1_sort_attr.c_str()) < atof(s2_sort_attr.c_str());
-    } else {
-      return s1_sort_attr < s2_sort_attr;
-    }
+  // The comparison operator. All attribute types compare bytewise.
+  bool operator() (const unsigned char* k1, const unsigned char* k2) const {
+    return memcmp(k1, k2, key_len) < 0;
   }
 } RecordCompare;
 
 /**
- * Comparison function object for comparing buffered records during the merge
+ * Comparison function object for comparing buffered records during the merge.
+ * Orders records so that the smallest one is at the top of the priority queue.
  */
 typedef struct {
 
   // Based on a RecordCompare struct
   RecordCompare rc;
 
-  bool operator() (BufRecord r1, BufRecord r2) { return !rc(r1.data, r2.data); }
+  bool operator() (const BufRecord& r1, const BufRecord& r2) const {
+    if (r1.prefix != r2.prefix) {
+      return r1.prefix > r2.prefix;
+    }
+    return rc.key_len > 8 && rc(r2.key, r1.key);
+  }
 
 } BufRecordCompare;
 
+/**
+ * A record in a run being sorted in memory, referred to by its
+ * index in the run, with its normalized key and key prefix
+ */
+typedef struct {
+  uint64_t prefix;
+  unsigned char* key;
+  long idx;
+} SortEntry;
+
+/**
+ * A record being sorted by sort_run, referred to by its normalized key
+ * (stored in front of the record, or built beside it), with its key prefix
+ */
+typedef struct {
+  uint64_t prefix;
+  char* key;
+} SlotEntry;
+
 /**
  * Priority queue for performing k-way merge
  */
-typedef priority_queue<BufRecord,vector<BufRecord>,BufRecordCompare> MergePriorityQueue;
+typedef priority_queue<BufRecord,BudgetVector<BufRecord>,BufRecordCompare> MergePriorityQueue;
+
+/**
+ * The data structure used to select the next record in a k-way merge
+ */
+typedef enum {
+  MERGE_HEAP,       // std::priority_queue, about 2*log2(k) comparisons per record
+  MERGE_LOSER_TREE  // tournament tree of losers, log2(k) comparisons per record
+} MergeEngine;
+
+/**
+ * Tournament ("loser") tree for k-way merging. Each internal node holds
+ * the index of the input that lost the match played there, and tree[0]
+ * holds the overall winner. When the winner is replaced by the next
+ * record from its input, only the matches on the path from its leaf to
+ * the root are replayed, so each output record costs log2(k) comparisons.
+ */
+class LoserTree {
+
+public:
+
+  // The number of inputs
+  int k;
+
+  // The current record of each input. Records are referred to by pointer
+  // only; an exhausted input has a NULL `data` pointer.
+  BufRecord *leaves;
+
+  // tree[0] is the index of the winning input, and tree[1..k-1] are the
+  // indices of the losers at each internal node
+  int *tree;
+
+  // For comparing the inputs' records
+  RecordCompare rc;
+
+  LoserTree(int k, RecordCompare rc);
+
+  ~LoserTree();
+
+  /**
+   * plays the whole tournament once every leaf has been set
+   */
+  void build();
+
+  /**
+   * replays the matches of input i after its leaf has changed
+   */
+  void replay(int i);
+
+  /**
+   * the index of the input holding the smallest record
+   */
+  int winner() const { return tree[0]; }
+
+  /**
+   * return true once every input is exhausted
+   */
+  bool empty() const { return leaves[tree[0]].data == NULL; }
+
+  /**
+   * return true if input i's record sorts before input j's
+   */
+  bool less(int i, int j) const;
+};
+
+/**
+ * The layout of the records in a run file. Runs passed between passes
+ * are binary: fixed-width records back to back, with no delimiters,
+ * each optionally preceded by its normalized key so that later passes
+ * need not rebuild it. The final output is text: each record is
+ * followed by a newline.
+ */
+typedef struct {
+
+  // The length of the key stored before each record (0 if keys are not stored)
+  int key_len;
+
+  // The length of a record
+  int record_len;
+
+  // Whether each record is followed by a newline
+  bool newline;
+
+  // The number of bytes each record takes up in the file
+  int stride;
+} RunFormat;
+
+/**
+ * Returns the binary format for intermediate runs, with or without
+ * stored keys
+ */
+RunFormat binary_format(Schema *schema, bool with_keys);
+
+/**
+ * Returns the text format of the final output
+ */
+RunFormat text_format(Schema *schema);
+
+/**
+ * Returns the layout of a list of bare normalized keys, such as the keys
+ * sampled to choose splitters: keys back to back, with no records
+ */
+RunFormat key_format(Schema *schema);
+
+/**
+ * Reads up to `len` bytes at position `pos` of `fd` into `buf`, retrying
+ * short reads. Returns the number of bytes read, which is less than `len`
+ * only at the end of the file.
+ */
+long pread_fully(int fd, char *buf, long len, long pos);
+
+/**
+ * Writes `len` bytes of `buf` at position `pos` of `fd`, retrying
+ * short writes
+ */
+void pwrite_fully(int fd, const char *buf, long len, long pos);
+
+/**
+ * Copies `len` bytes at position `in_pos` of `in_fd` to position `out_pos`
+ * of `out_fd` within the kernel (copy_file_range, which may share the data
+ * rather than copy it), falling back to preads and pwrites through the
+ * `buf_size` bytes of `buf` if the files do not support that
+ */
+void copy_fully(int in_fd, long in_pos, int out_fd, long out_pos, long len, char *buf,
+                long buf_size);
+
+/**
+ * A read or write of a whole buffer, to be carried out by an IOThread
+ */
+typedef struct {
+  bool write;
+  int fd;
+  char *buf;
+  long len;
+  long pos;
+
+  // The number of bytes transferred
+  long result;
+
+  // Whether the request has been submitted and not yet waited for,
+  // and whether the I/O thread has completed it
+  bool pending;
+  bool done;
+} IORequest;
+
+/**
+ * A background thread that carries out reads and writes in the order they
+ * are submitted, so that disk I/O overlaps with merging
+ */
+class IOThread {
+
+public:
+
+  IOThread();
+
+  /**
+   * completes any queued requests, then stops the thread
+   */
+  ~IOThread();
+
+  /**
+   * queues a request. Its buffer must not be touched until it is waited for.
+   */
+  void submit(IORequest *req);
+
+  /**
+   * blocks until a submitted request has completed. Returns immediately
+   * if the request is not pending.
+   */
+  void wait(IORequest *req);
+
+private:
+
+  void run();
+
+  thread worker;
+  mutex mtx;
+  condition_variable submitted;
+  condition_variable completed;
+  deque<IORequest*> queue;
+  bool stop;
+};
+
+/**
+ * The scratch file holding the runs between passes. Runs are allocated as
+ * extents at the end of the file, and the disk space of the extents is
+ * given back (by punching holes in the file) as soon as merges have read
+ * them, so that the file takes up about as much disk as one copy of the
+ * input, however many passes there are. The file is removed once the
+ * store is destroyed.
+ */
+class RunStore {
+
+public:
+
+  /**
+   * opens the scratch file `filename`, whose existing contents (the runs
+   * made by pass 0) are already allocated
+   */
+  RunStore(char *filename);
+
+  /**
+   * closes and removes the scratch file
+   */
+  ~RunStore();
+
+  /**
+   * allocates an extent of `len` bytes and returns its position
+   */
+  long allocate(long len);
+
+  /**
+   * frees the `len` bytes at `pos`. Only whole blocks are given back to the
+   * file system, once every byte in them has been freed.
+   */
+  void release(long pos, long len);
+
+  // The scratch file and its descriptor
+  char *filename;
+  int fd;
+
+private:
+
+  mutex mtx;
+
+  // The free extents not yet given back, by position, and their ends
+  map<long, long> free_extents;
+
+  // The end of the allocated part of the file
+  long end;
+
+  // The file system block size
+  long block_size;
+};
+
+/**
+ * A buffer of fixed-width records on their way to a file. Records are
+ * appended at a write cursor, laid out exactly as they will be in the file,
+ * and a full buffer is written out with a single pwrite.
+ */
+class OutputBuffer {
+
+public:
+
+  /**
+   * buffers records laid out in `format` for the open file `fd`, starting
+   * at position `pos`, in the `buf_size` bytes of `buf` (or, if `buf` is
+   * NULL, of a buffer allocated from the memory budget). If `io` is not
+   * NULL, the buffer is written by `io` one half at a time while the other
+   * half is filled.
+   */
+  OutputBuffer(int fd, long pos, RunFormat format, char *buf, long buf_size, IOThread *io);
+
+  /**
+   * writes out any records still buffered
+   */
+  ~OutputBuffer();
+
+  /**
+   * appends a record and its normalized key (written only if the format
+   * stores keys). Records are not null-terminated, so exactly the format's
+   * record length is copied.
+   */
+  void append(const unsigned char *key, const char *record) {
+    char *slot = this->halves[this->cur_half] + this->count * this->format.stride;
+    memcpy(slot, key, this->format.key_len);
+    memcpy(slot + this->format.key_len, record, this->record_len);
+    if (this->format.newline) {
+      slot[this->format.key_len + this->record_len] = '\n';
+    }
+    if (++this->count == this->capacity) {
+      this->flush();
+    }
+  }
+
+  /**
+   * writes out the buffered records (in the background, with an I/O
+   * thread) and empties the buffer
+   */
+  void flush();
+
+  /**
+   * writes out the buffered records and waits for every write to complete
+   */
+  void finish();
+
+  // The position in the file of the next record appended
+  long pos() const { return this->out_pos + this->count * this->format.stride; }
+
+private:
+
+  int fd;
+  RunFormat format;
+  long record_len;
+
+  // The buffer, whether it was allocated here, and its halves (just one,
+  // without an I/O thread)
+  char *buf;
+  bool owned;
+  char *halves[2];
+  int cur_half;
+
+  // The number of records each half holds, and the number in the current one
+  long capacity;
+  long count;
+
+  // The position in the file the current half is written to
+  long out_pos;
+
+  // The I/O thread, if any, and each half's pending write
+  IOThread *io;
+  IORequest writes[2];
+};
 
 /**
  * The iterator helps you scan through a run.
@@ -108,6 +639,9 @@ public:
   // The name of the file containing the records for this run
   char *filename;
 
+  // The descriptor of `filename`, kept open from one run to the next
+  int fd;
+
   // The position in the file of the first record in this run,
   // specified as a record index
   long start_pos;
@@ -123,12 +657,23 @@ public:
   // The size of the buffer (in bytes) used to read the run
   long buf_size;
 
-  // The number of records that can fit in the buffer
+  // The number of records that can fit in the buffer (or in each half
+  // of it, when prefetching)
   long buf_record_capacity;
 
-  // The buffer
+  // The buffer holding the current section of the run
   char *buf;
 
+  // The memory allocated for the buffer
+  char *buf_alloc;
+
+  // When prefetching, the I/O thread reading the next section of the run
+  // into the other half of the buffer, that half, and the pending read.
+  // `io` is NULL if the run is read synchronously.
+  IOThread *io;
+  char *prefetch_buf;
+  IORequest prefetch;
+
   // Current record index within the RUN
   long record_idx;
 
@@ -138,15 +683,37 @@ public:
   // The record schema
   Schema *schema;
 
-  // The current record the iterator is pointing to. We know we technically
-  // shouldn't have this.
-  char *cur_record;
+  // The layout of the records in the file
+  RunFormat format;
+
+  // The key stored before the current record, if the format stores keys
+  unsigned char *cur_key;
+
+  // Whether the run is read through a memory mapping of the file rather
+  // than through `buf`
+  bool use_mmap;
+
+  // If not NULL, the store the run was allocated from, and the position up
+  // to which the run has been read and released to the store
+  RunStore *store;
+  long released_pos;
+
+  // The mapping of the file region holding the run (starting at the page
+  // boundary at or before start_pos), its length, and the run's first record
+  char *map;
+  long map_len;
+  char *run_data;
 
   /**
    * Alternative constructor to initialize the iterator without
-   * actually loading the run
+   * actually loading the run. If `use_mmap` is set, runs are
+   * memory-mapped and no buffer is allocated. Otherwise, if `io`
+   * is not NULL, the next section of the run is prefetched by
+   * `io` while the current one is consumed. If `store` is not NULL,
+   * runs are released to it as they are read.
    */
-  RunIterator(long buf_size, Schema *schema);
+  RunIterator(long buf_size, Schema *schema, RunFormat format, bool use_mmap,
+              IOThread *io, RunStore *store);
 
   /**
    * destructor
@@ -161,7 +728,26 @@ public:
   void reset(char *filename, long start_pos, long run_length);
 
   /**
-   * reads the next record
+   * reads the next section of the run, starting at next_section_pos,
+   * into the buffer
+   */
+  void fill_buffer();
+
+  /**
+   * maps the current run of `filename` into memory
+   */
+  void map_run();
+
+  /**
+   * releases the run up to position `pos` to the store, if any
+   */
+  void release(long pos);
+
+  /**
+   * reads the next record, setting `cur_key` to its stored key. The returned
+   * record is not null-terminated, and points into the buffer (or mapping):
+   * it stays valid until has_next() is next called, which may refill the
+   * buffer.
    */
   char* next();
 
@@ -172,17 +758,287 @@ public:
   bool has_next();
 };
 
+/**
+ * A sorted run within a file: the byte position of its
+ * first record and its length in records
+ */
+typedef struct {
+  long start_pos;
+  long length;
+} Run;
+
+/**
+ * A run being created by mk_runs_parallel: its position in the input,
+ * its input lines (each followed by a newline), their number, and once
+ * sorted, its records laid out in the run format
+ */
+typedef struct {
+  long seq;
+  BudgetVector<char> lines;
+  BudgetVector<char> sorted;
+  long length;
+} RunChunk;
+
+/**
+ * Returns a pointer to the first `c` in [begin, end), or `end` if there is
+ * none. Compares 16 bytes at a time (SSE2), or 32 if built with AVX2.
+ */
+const char* find_char(const char *begin, const char *end, char c);
+
+/**
+ * Lays out the CSV record in the `len` bytes at `line` in `record` as in the
+ * run files: each attribute at its offset, padded with spaces to its schema
+ * length. The commas are found a vector at a time, and the attributes are
+ * copied straight from the line. A record with a different number of
+ * attributes than the schema, or an attribute longer than its schema
+ * length, is an error.
+ */
+void parse_record(const char *line, long len, Schema *schema, char *record);
+
+// The largest block a LineReader reads
+static const long LINE_BLOCK_SIZE = 1 << 16;
+
+/**
+ * Returns the size of the blocks a LineReader reads: LINE_BLOCK_SIZE, or a
+ * sixteenth of the memory budget if that is smaller (but at least a few
+ * lines)
+ */
+long line_block_size();
+
+/**
+ * Returns the size of the buffers records are written through outside the
+ * merge: like line_block_size, but at least a record laid out in `format`
+ */
+long output_block_size(RunFormat format);
+
+/**
+ * Returns the longest a valid CSV line for `schema` can be: every
+ * attribute at full length, with the commas and a CRLF
+ */
+long max_line_length(Schema *schema);
+
+/**
+ * Reads a file a large block at a time and returns its lines in place,
+ * without copying them
+ */
+class LineReader {
+
+public:
+
+  /**
+   * opens `filename` for reading
+   */
+  LineReader(char *filename);
+
+  /**
+   * closes the file
+   */
+  ~LineReader();
+
+  /**
+   * points `line` at the next line and sets `len` to its length (without
+   * the newline). The line stays valid until the next call. Returns false
+   * at the end of the file.
+   */
+  bool next(const char **line, long *len);
+
+private:
+
+  int fd;
+
+  // The block of the file in memory, and the part of it not yet returned
+  BudgetVector<char> block;
+  long begin;
+  long end;
+
+  // Whether the whole file has been read into the block
+  bool eof;
+};
+
+/**
+ * The layout of the arena a run is sorted in during pass 0: fixed-width
+ * slots back to back, each holding a record's normalized key followed by
+ * the record (the binary format with keys)
+ */
+RunFormat arena_format(Schema *schema);
+
+/**
+ * Fills the arena slot `slot` from the CSV record in the `len` bytes at
+ * `line`: the record, laid out by parse_record, and its normalized key
+ */
+void fill_slot(const char *line, long len, Schema *schema, char *slot);
+
+/**
+ * Returns the number of records pass 0 can sort in `mem_capacity` with
+ * `num_threads` threads, besides the LineReader's block: each takes an
+ * arena slot, a SlotEntry, and its space in the sorted output, laid out in
+ * `format` (or as text, if that is larger). With more than one thread, the
+ * records' input lines are held as well, until they are parsed.
+ */
+long run_capacity(long mem_capacity, Schema *schema, RunFormat format, int num_threads);
+
+/**
+ * Returns the number of records replacement selection can hold in its heap
+ * in `mem_capacity`, besides the LineReader's block
+ */
+long replacement_capacity(long mem_capacity, Schema *schema);
+
+/**
+ * Sorts the `num_records` records in `records`, laid out in `format`, by
+ * their normalized keys, and lays them out in `out_format` in `out`. Keys
+ * stored in `format` (as in a pass 0 arena) are sorted in place; otherwise
+ * they are built first. Integer and string keys are sorted by radix.
+ */
+void sort_run(char *records, long num_records, Schema *schema, RunFormat format,
+              RunFormat out_format, char *out);
+
 /**
  * Creates sorted runs of length `run_length` in
- * the `out_fp`.
+ * the `out_fp`, laid out in `format`. Appends the
+ * runs created to `runs`. Runs already in ascending or
+ * descending order are not sorted, and a run is extended
+ * by the next when its keys continue in order. If the
+ * runs end up ordered, so that the whole input is sorted
+ * by concatenating them (a single run, or runs in
+ * descending order, listed in reverse), `ordered` is set
+ * and they are laid out in `single_format` instead (the
+ * output format, so that they can be copied as is).
+ */
+int mk_runs(char *in_filename, char *out_filename, long run_length, Schema *schema,
+            RunFormat format, RunFormat single_format, BudgetVector<Run> &runs, bool &ordered);
+
+/**
+ * Creates sorted runs like mk_runs, but pipelined across threads: a reader
+ * thread cuts the input into runs, `num_threads` workers parse and sort
+ * them concurrently, and the calling thread writes them out in input
+ * order. The `run_length` records that fit in memory are shared between
+ * the workers, so each run is `run_length / num_threads` records long.
+ */
+int mk_runs_parallel(char *in_filename, char *out_filename, long run_length, Schema *schema,
+                     RunFormat format, int num_threads, BudgetVector<Run> &runs);
+
+/**
+ * Creates sorted runs in the `out_fp` by replacement selection, holding
+ * at most `heap_capacity` records in memory. On random input the runs
+ * average twice the heap capacity; sorted or nearly sorted input yields
+ * a single run. Runs are laid out in `format`. Appends the runs created
+ * to `runs`.
+ */
+int mk_runs_replacement(char *in_filename, char *out_filename, long heap_capacity,
+                        Schema *schema, RunFormat format, BudgetVector<Run> &runs);
+
+/**
+ * Sample sort, first step: reads the records following `num_samples`
+ * random positions of the CSV file `in_filename`, and returns an estimate
+ * of the number of records in the file. Unless `samples` is NULL, their
+ * normalized keys are returned in it, sorted, back to back.
+ */
+long sample_keys(char *in_filename, Schema *schema, long num_samples, BudgetVector<char> *samples);
+
+/**
+ * Returns the number of keys sample_keys can sample and sort within
+ * `mem_capacity`
+ */
+long sample_capacity(long mem_capacity, Schema *schema);
+
+/**
+ * Sample sort, first pass: streams the records of `in_filename` into the
+ * partition files `part_filenames`, laid out in `format`. `splitters`
+ * holds normalized keys back to back, and partition p gets the records
+ * whose keys are at least splitter p - 1 and less than splitter p, so
+ * there is one more partition than splitters. The output buffers of the
+ * partitions share `mem_capacity` with the splitters. The number of
+ * records in each partition is returned in `part_lengths`.
+ */
+void mk_partitions(char *in_filename, vector<string> &part_filenames, BudgetVector<char> &splitters,
+                   Schema *schema, RunFormat format, long mem_capacity,
+                   vector<long> &part_lengths);
+
+/**
+ * Returns the most partitions mk_partitions can write within
+ * `mem_capacity` when each output buffer holds at least one record laid
+ * out in `format`, and each partition has a splitter key
+ */
+long partition_capacity(long mem_capacity, Schema *schema, RunFormat format);
+
+/**
+ * Returns the number of records in `format` that sort_partition can sort
+ * in memory within `mem_capacity`, writing them out in `out_format`
+ */
+long sort_capacity(long mem_capacity, Schema *schema, RunFormat format, RunFormat out_format);
+
+/**
+ * Sample sort, second pass: sorts the `length` records of the partition
+ * file `filename`, laid out in `format`, using at most `mem_capacity` of
+ * memory, and writes them in `out_format` to the open file `out_fd`
+ * starting at position `out_pos`. A partition too large to sort in memory
+ * is sorted in chunks in place and the chunks merged with `engine`.
  */
-int mk_runs(char *in_filename, char *out_filename, long run_length, Schema *schema);
+void sort_partition(char *filename, long length, long mem_capacity, RunFormat format,
+                    int out_fd, long out_pos, RunFormat out_format, RecordCompare rc,
+                    MergeEngine engine);
+
+/**
+ * Returns the memory a merge of `fan_in` runs takes from the budget besides
+ * its input and output buffers: its key slots, its priority queue or loser
+ * tree, and the alignment of each block
+ */
+long merge_overhead(Schema *schema, int fan_in);
 
 /**
  * Merge runs given by the `iterators`.
  * The number of `iterators` should be equal to the `num_runs`.
- * Write the merged runs to `out_fp` starting at position `start_pos`.
+ * Write the merged runs to the open file `out_fd` starting at position `start_pos`.
  * Cannot use more than `buf_size` of heap memory allocated to `buf`.
+ * `engine` selects how the next record to output is chosen. If `io` is
+ * not NULL, the output buffer is written by `io` one half at a time
+ * while the merge fills the other half. The merged run is written in
+ * `out_format`. A single run already laid out in `out_format` is copied
+ * to the output file as is.
+ */
+void merge_runs(RunIterator* iterators[], int num_runs, int out_fd,
+                long start_pos, long buf_size, char* buf, RecordCompare rc,
+                MergeEngine engine, IOThread *io, RunFormat out_format);
+
+/**
+ * One pass of a merge plan: the number of runs it starts with, how many of
+ * them it merges (the rest are passed through untouched), its fan-in (the
+ * most runs merged together), and the number of runs it leaves
+ */
+typedef struct {
+  long num_runs;
+  long runs_merged;
+  int fan_in;
+  long runs_out;
+} MergePass;
+
+/**
+ * Plans the merge passes for `num_runs` runs with a fan-in of at most `k`.
+ * Every pass but the first merges all of its runs in groups of exactly k
+ * (fewer on the final pass if there are fewer runs). The first pass merges
+ * only as many runs as it takes to leave a power of k, so that no pass
+ * rewrites the whole dataset for a few stragglers. A single run still
+ * takes one pass, to be copied to the output.
+ */
+vector<MergePass> plan_merge(long num_runs, int k);
+
+/**
+ * Returns the memory the lists of runs take while merging `num_runs` runs
+ * from pass 0 with a fan-in of at most `k` and `num_threads` threads: the
+ * runs themselves, the runs a pass merges them into, and the sections of
+ * the runs of a partitioned merge
+ */
+long run_list_size(long num_runs, int k, int num_threads);
+
+/**
+ * Splits the merge of the `num_runs` sorted `runs` in `filename`, laid out
+ * in `format`, into `num_parts` merges of disjoint key ranges. Splitter
+ * keys are chosen from a sample of every run (as large as fits in
+ * `mem_capacity`), and each run is binary-searched for them. `sections` is
+ * filled with, for each key range in order, the section of every run that
+ * falls in it (possibly empty): key range p's sections are
+ * sections[p * num_runs] to sections[(p + 1) * num_runs - 1].
  */
-void merge_runs(RunIterator* iterators[], int num_runs, char *out_filename,
-                long start_pos, long buf_size, char* buf, RecordCompare rc);
+void partition_runs(char *filename, const Run *runs, int num_runs, RunFormat format,
+                    RecordCompare rc, int num_parts, long mem_capacity,
+                    BudgetVector<Run> &sections);
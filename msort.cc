@@ -1,25 +1,113 @@
 #include <cstdlib>
 #include <cstdio>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
 
 #include "library.h"
 #include "json/json.h"
 
 using namespace std;
 
+// The most partitions sample sort writes at once (each is an open file)
+static const long MAX_PARTITIONS = 256;
+
+// The number of keys sampled per partition to choose the splitters
+static const long SAMPLES_PER_PARTITION = 32;
+
+// Command line options, which may precede the positional arguments
+static struct option long_options[] = {
+  {"replacement-selection", no_argument, NULL, 'r'},
+  {"loser-tree", no_argument, NULL, 'l'},
+  {"mmap", no_argument, NULL, 'm'},
+  {"prefetch", no_argument, NULL, 'p'},
+  {"store-keys", no_argument, NULL, 's'},
+  {"threads", required_argument, NULL, 't'},
+  {"sample-sort", no_argument, NULL, 'S'},
+  {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char* argv[]) {
-  if (argc < 7) {
+
+  // Whether pass 0 uses replacement selection instead of fixed-length runs
+  bool replacement_selection = false;
+
+  // How the merge passes pick the next record among the k runs
+  MergeEngine engine = MERGE_HEAP;
+
+  // Whether the merge passes read runs through memory mappings
+  bool use_mmap = false;
+
+  // Whether the merge passes overlap disk I/O with merging
+  bool prefetch = false;
+
+  // Whether intermediate runs store each record's normalized key
+  bool store_keys = false;
+
+  // The number of threads to sort with
+  int num_threads = 1;
+
+  // Whether to sort by partitioning the input at sampled keys instead of
+  // merging runs
+  bool sample_sort = false;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "rlmpst:S", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'r':
+        replacement_selection = true;
+        break;
+      case 'l':
+        engine = MERGE_LOSER_TREE;
+        break;
+      case 'm':
+        use_mmap = true;
+        break;
+      case 'p':
+        prefetch = true;
+        break;
+      case 's':
+        store_keys = true;
+        break;
+      case 't':
+        num_threads = max(1, atoi(optarg));
+        break;
+      case 'S':
+        sample_sort = true;
+        break;
+      default:
+        exit(1);
+    }
+  }
+
+  if (argc - optind < 6) {
     cout << "ERROR: invalid input parameters!" << endl;
-    cout << "Please enter <schema_file> <input_file> <output_file> <mem_capacity> <k> <sorting_attributes>" << endl;
+    cout << "Please enter [options] <schema_file> <input_file> <output_file> <mem_capacity> <k> <sorting_attributes>" << endl;
     exit(1);
   }
 
   // Read in command line arguments
-  string schema_file(argv[1]);
-  char *input_file = argv[2];
-  char *output_file = argv[3];
-  long mem_capacity = atol(argv[4]);
-  int k = atoi(argv[5]);
-  string sort_attribute(argv[6]); // assuming a single sort attribute for now
+  char **args = argv + optind;
+  string schema_file(args[0]);
+  char *input_file = args[1];
+  char *output_file = args[2];
+  long mem_capacity = atol(args[3]);
+  int k = atoi(args[4]);
+  vector<string> sort_attributes; // sorting attributes, in priority order
+
+  // A merge needs at least two runs to merge at a time
+  if (k < 2) {
+    cout << "ERROR: invalid input parameters!" << endl;
+    cout << "k must be at least 2" << endl;
+    exit(1);
+  }
+
+  // Iterate through the sorting attributes and
+  // put each into the sorting attribute storage
+  for (int i = optind + 5; i < argc; ++i) {
+    sort_attributes.push_back(argv[i]);
+  }
 
   // Parse the schema JSON file
   Json::Value json_schema;
@@ -38,13 +126,14 @@ int main(int argc, char* argv[]) {
   Schema schema;
   schema.nattrs = json_schema.size();
   schema.attrs = (Attribute*) malloc(sizeof(Attribute) * schema.nattrs);
-  schema.n_sort_attrs = 1; // TODO: change if we end up supporting multiple sort attributes
+  schema.n_sort_attrs = sort_attributes.size();
   schema.sort_attrs = (int*) malloc(sizeof(int) * schema.n_sort_attrs);
 
   // Variables for loading an attribute
   string attr_name;
   string attr_type;
   int attr_len;
+  int sort_attr_count = 0;
   
   // Load and print out the schema
   for (int i = 0; i < json_schema.size(); ++i) {
@@ -55,9 +144,9 @@ int main(int argc, char* argv[]) {
 
     // Create an Attribute struct for the current attribute
     Attribute attribute;
-    attribute.name = (char*) malloc(sizeof(attr_name.c_str()));
+    attribute.name = (char*) malloc(attr_name.size() + 1);
     strcpy(attribute.name, attr_name.c_str());
-    attribute.type = (char*) malloc(sizeof(attr_type.c_str()));
+    attribute.type = (char*) malloc(attr_type.size() + 1);
     strcpy(attribute.type, attr_type.c_str());
     attribute.length = attr_len;
     attribute.offset = schema.total_record_length;
@@ -67,133 +156,448 @@ int main(int argc, char* argv[]) {
     schema.total_record_length += attr_len;
 
     // If this is a sorting attribute, add it to the list
-    // of sort attributes
-    if (sort_attribute.compare(attr_name) == 0) {
-      schema.sort_attrs[0] = i;
+    // of sort attributes at its priority
+    auto it = find(sort_attributes.begin(), sort_attributes.end(), attr_name);
+    if (it != sort_attributes.end()) {
+      schema.sort_attrs[it - sort_attributes.begin()] = i;
+      sort_attr_count++;
     }
   }
 
-  // k input buffers for merging + 1 output buffer
-  int buf_size = mem_capacity / (k + 1);
+  // Raise an error if a sorting attribute does not exist in schema
+  if (sort_attr_count != schema.n_sort_attrs) {
+    cout << "ERROR: invalid sorting attribute name" << endl;
+    exit(1);
+  }
 
-  // The length of a run is measured in # of records and is initially
-  // determined by the size of the buffer and the total length
-  // of a record (+1 for null-terminating character)
-  long run_length = buf_size / (schema.total_record_length + 1);
+  // Every buffer that grows with the input is allocated from the memory
+  // budget, which exits rather than exceed mem_capacity
+  MemoryBudget budget(mem_capacity);
+  set_memory_budget(&budget);
 
-  // Helper files for reading and writing runs
+  // Scratch file holding the runs between passes
   char* helper = (char*) "helper.txt";
-  char* helper2 = (char*) "helper2.txt";
 
-  // First phase: Make the runs
-  int num_runs = mk_runs(input_file, helper, run_length, &schema);
+  // Runs are passed between passes in binary; only the final
+  // output is written as text
+  RunFormat run_format = binary_format(&schema, store_keys);
+  RunFormat out_format = text_format(&schema);
+
+  // Struct for comparing records by their normalized keys
+  RecordCompare rc {&schema, key_length(&schema)};
+
+  // Estimate the number of records from the length of a sample of lines
+  long est_records = sample_keys(input_file, &schema, 1000, NULL);
+
+  // Sample sort: partition the input at sampled splitter keys so that each
+  // partition fits in memory, then sort the partitions independently. The
+  // sorted partitions are concatenated, so records are read and written
+  // twice, however large the input. Partitions are sorted num_threads at a
+  // time, so each may use 1/num_threads of the memory.
+  if (sample_sort) {
+    long part_mem = budget.capacity / num_threads;
+    long capacity = sort_capacity(part_mem, &schema, run_format, out_format);
+
+    // Aim for partitions half the size of memory, to allow for sampling
+    // error
+    long num_parts = max((long) num_threads, 2 * est_records / max(1L, capacity) + 1);
+    long max_parts = min(MAX_PARTITIONS, partition_capacity(budget.capacity, &schema, run_format));
+    if (capacity > 0 && num_parts <= max_parts) {
+      // The splitters outlive the sample, so they are allocated first, to
+      // leave the memory the sample frees in one piece
+      BudgetVector<char> splitters;
+      splitters.reserve((num_parts - 1) * rc.key_len);
+      long sample_mem = budget.capacity - budget_size(splitters.capacity(), 1);
+      BudgetVector<char> samples;
+      sample_keys(input_file, &schema, min(SAMPLES_PER_PARTITION * num_parts,
+                                           sample_capacity(sample_mem, &schema)), &samples);
+
+      // Choose the splitters evenly from the sample, and free the rest of it
+      long num_samples = samples.size() / rc.key_len;
+      for (long p = 1; p < num_parts && num_samples > 0; p++) {
+        char *sample = &samples[p * num_samples / num_parts * rc.key_len];
+        splitters.insert(splitters.end(), sample, sample + rc.key_len);
+      }
+      BudgetVector<char>().swap(samples);
+      num_parts = splitters.size() / rc.key_len + 1;
 
-  // The number of passes we have to do for the merge is log_k(num_runs)
-  int num_passes = ceil(log(num_runs) / log(k));
+      cout << "capacity : " << capacity << ", est_records : " << est_records <<
+            ", num_partitions : " << num_parts << endl;
 
-  cout << "buf_size : " << buf_size << ", run_length : " << run_length << 
-        ", num_runs : " << num_runs <<", num_passes : " << num_passes << endl;
+      // First pass: stream the records into the partition files
+      vector<string> part_filenames;
+      for (long p = 0; p < num_parts; p++) {
+        part_filenames.push_back("partition" + to_string(p) + ".txt");
+      }
+      vector<long> part_lengths;
+      mk_partitions(input_file, part_filenames, splitters, &schema, run_format, budget.capacity,
+                    part_lengths);
+      BudgetVector<char>().swap(splitters);
+
+      // Each sorted partition starts after all the records before it
+      vector<long> out_pos(num_parts, 0);
+      for (long p = 1; p < num_parts; p++) {
+        out_pos[p] = out_pos[p - 1] + part_lengths[p - 1] * out_format.stride;
+      }
 
-  // Second phase: Do in-memory sort
+      int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (out_fd < 0) {
+        cout << "could not open " << output_file << " for sorting partitions" << endl;
+        exit(1);
+      }
 
-  // The attribute to sort on
-  Attribute sort_attr = schema.attrs[schema.sort_attrs[0]];
+      // Second pass: sort the partitions, num_threads at a time
+      atomic<long> next_part(0);
+      auto sort_thread = [&] () {
+        for (long p = next_part++; p < num_parts; p = next_part++) {
+          sort_partition((char*) part_filenames[p].c_str(), part_lengths[p], part_mem, run_format,
+                         out_fd, out_pos[p], out_format, rc, engine);
+          unlink(part_filenames[p].c_str());
+        }
+      };
+      vector<thread> sort_threads;
+      for (int t = 1; t < num_threads; t++) {
+        sort_threads.push_back(thread(sort_thread));
+      }
+      sort_thread();
+      for (size_t t = 0; t < sort_threads.size(); t++) {
+        sort_threads[t].join();
+      }
+      close(out_fd);
 
-  // Indicates whether the sort attirubte is a numeric value
-  bool is_numeric = (strcmp(sort_attr.type, INTEGER) == 0) || (strcmp(sort_attr.type, FLOAT) == 0);
+      cout << "peak memory : " << budget.peak << " of " << mem_capacity << " bytes" << endl;
+      free(schema.attrs);
+      free(schema.sort_attrs);
+      return 0;
+    }
 
-  // Struct for comparing records
-  RecordCompare rc {sort_attr.offset, sort_attr.length, is_numeric};
+    // Too many partitions would be open at once, or their output buffers
+    // would not fit in memory; merge runs instead
+    cout << "input too large for sample sort, merging runs instead" << endl;
+  }
 
-  // The number of runs that have been sorted so far on the current pass
-  int runs_sorted = 0;
+  // Lambda for the number of records in a run from pass 0 when it has
+  // `mem` bytes. Pass 0 sorts a run at a time in an arena of fixed-width
+  // slots, so a run is as many records as fit in memory along with their
+  // sort entries and output.
+  auto pass0_capacity = [&] (long mem) {
+    return replacement_selection ? replacement_capacity(mem, &schema) :
+                                   run_capacity(mem, &schema, run_format, num_threads);
+  };
+
+  // Lambda for an upper estimate of the number of runs pass 0 makes when
+  // each holds `run_length` records (with threads, each worker sorts a
+  // share of them as a run of its own)
+  auto est_runs = [&] (long run_length) {
+    long chunk_length = max(1L, run_length / max(1L, min((long) num_threads, run_length)));
+    long num_runs = est_records / chunk_length + 1;
+    return num_runs + num_runs / 8;
+  };
+
+  // The list of runs takes memory away from pass 0, which makes the runs
+  // shorter and the list longer, so the length of a run is measured in #
+  // of records and shortened until the runs it makes fit alongside it
+  long run_length = pass0_capacity(budget.capacity);
+  while (run_length > 0) {
+    long shorter = pass0_capacity(budget.capacity -
+                                  run_list_size(est_runs(run_length), k, num_threads));
+    if (shorter >= run_length) {
+      break;
+    }
+    run_length = shorter;
+  }
+  if (run_length < 1) {
+    cout << "ERROR: mem_capacity too small to make runs and keep track of them (about " <<
+          est_records << " records)" << endl;
+    exit(1);
+  }
 
-  // The number of buffers required for the current merge operation
-  // (This is k, except at the very end of the list of runs)
-  int buffers_needed = k;
+  // The sorted runs in the current pass's input file
+  BudgetVector<Run> runs;
+  runs.reserve(est_runs(run_length));
+
+  // First phase: Make the runs. Replacement selection keeps as many records
+  // in memory as a fixed-length run would hold, but produces longer runs.
+  int num_runs;
+  bool ordered = false;
+  if (replacement_selection) {
+    num_runs = mk_runs_replacement(input_file, helper, run_length, &schema, run_format, runs);
+  } else if (num_threads > 1) {
+    num_runs = mk_runs_parallel(input_file, helper, run_length, &schema, run_format, num_threads, runs);
+  } else {
+    num_runs = mk_runs(input_file, helper, run_length, &schema, run_format, out_format, runs,
+                       ordered);
+  }
 
-  // The starting position in the input file for the merge operation
-  int merge_start_pos = 0;
+  // Ordered runs from mk_runs (a lone run, or presorted input) are already
+  // laid out like the output, so the final pass just copies them
+  RunFormat input_format = ordered ? out_format : run_format;
+
+  // The runs each pass merges into (one per merge of at least two runs, or
+  // one per ordered run), and the sections of the runs of a partitioned
+  // merge, are allocated once for every pass
+  BudgetVector<Run> merged_runs;
+  merged_runs.reserve(max(ordered ? (long) runs.size() : (long) (runs.capacity() + 1) / 2,
+                          (long) num_threads));
+  BudgetVector<Run> sections;
+  if (num_threads > 1) {
+    sections.reserve(num_threads * k);
+  }
 
-  /**
-   * On a given pass, we read from one file and write to another
-   * (simultaneous reading and writing of the same file doesn't
-   * work here for obvious reasons). The output for the previous
-   * pass becomes the input to the next one. On the final pass,
-   * the output is written to the specified output file.
-   */
-  char* curr_pass_input = helper;
-  char* curr_pass_output = helper2;
+  // The memory left for merging once the lists of runs are allocated
+  long merge_capacity = budget.capacity -
+                        budget_size((runs.capacity() + merged_runs.capacity() + sections.capacity()) *
+                                    sizeof(Run), 3);
+
+  // The size of each input buffer and output buffer of a merge of `fan_in`
+  // runs, when `concurrency` merges share the budget
+  auto merge_buffer_size = [&] (int concurrency, int fan_in) {
+    return (merge_capacity / concurrency - merge_overhead(&schema, fan_in)) / (fan_in + 1);
+  };
+
+  // Every merge buffer must hold at least a record, so k is capped at the
+  // largest fan-in whose buffers still do
+  long min_buf_size = max(run_format.stride, out_format.stride);
+  int max_k = k;
+  while (max_k > 2 && merge_buffer_size(1, max_k) < min_buf_size) {
+    max_k--;
+  }
+  if (merge_buffer_size(1, max_k) < min_buf_size) {
+    cout << "ERROR: mem_capacity too small to merge runs" << endl;
+    exit(1);
+  }
+  if (max_k < k) {
+    cout << "k : " << k << " capped at " << max_k << " so that every buffer holds a record" << endl;
+    k = max_k;
+  }
 
-  char* output_buffer = new char[buf_size];
+  // Plan the merge passes. The number of passes is log_k(num_runs), but
+  // the first may merge only some of the runs. Ordered runs are not merged
+  // at all: a single pass copies each of them in turn.
+  vector<MergePass> plan = plan_merge(num_runs, k);
+  if (ordered) {
+    plan.assign(1, MergePass {num_runs, num_runs, 1, 1});
+  }
+  int num_passes = plan.size();
+
+  // Lambda for the number of merges of `fan_in` runs to run at once: as
+  // many as there are threads (and merges), as long as each merge's share
+  // of memory still holds a couple of records per buffer
+  auto merge_concurrency = [&] (long num_merges, int fan_in) {
+    int concurrency = max(1L, min((long) num_threads, num_merges));
+    while (concurrency > 1 && merge_buffer_size(concurrency, fan_in) < 2 * (long) run_format.stride) {
+      concurrency--;
+    }
+    return concurrency;
+  };
 
-  // Initialize the k input buffers
-  RunIterator* iters[k];
-  for (int i = 0; i < k; i++) {
-    iters[i] = new RunIterator(buf_size, &schema);
+  // The header shows the buffer size of a merge of k runs with all of
+  // memory; each pass below shows the size it actually uses
+  cout << "buf_size : " << merge_buffer_size(1, k) << ", run_length : " << run_length <<
+        ", num_runs : " << num_runs <<", num_passes : " << num_passes << endl;
+  for (int pass = 0; pass < num_passes; pass++) {
+    // A pass that is a single merge is split into one merge per thread
+    long num_merges = (plan[pass].runs_merged + plan[pass].fan_in - 1) / plan[pass].fan_in;
+    if (num_merges == 1) {
+      num_merges = num_threads;
+    }
+    int pass_concurrency = merge_concurrency(num_merges, plan[pass].fan_in);
+    cout << "pass " << pass + 1 << " : merge " << plan[pass].runs_merged << " of " <<
+          plan[pass].num_runs << " runs with fan-in " << plan[pass].fan_in << " (buf_size : " <<
+          merge_buffer_size(pass_concurrency, plan[pass].fan_in) << "), " << plan[pass].runs_out <<
+          " runs out" << endl;
   }
 
+  // Second phase: Do in-memory sort
+
+  /**
+   * Every pass reads its runs from the scratch file and, except for the
+   * final pass, appends the merged runs to it. Runs are freed as they are
+   * merged, so the scratch file takes up about as much disk as the input.
+   * The final pass writes straight into the specified output file.
+   */
+  RunStore* store = new RunStore(helper);
+
+  // Background thread for prefetching runs and writing merged output
+  IOThread* io = prefetch ? new IOThread() : NULL;
+
+  // The number of merges run concurrently, their fan-in, and the size of
+  // each of their input buffers and output buffer. Concurrent merges share
+  // mem_capacity equally.
+  int concurrency = 0;
+  int fan_in = 0;
+  long merge_buf_size = 0;
+
+  // The input buffers (fan_in per concurrent merge) and output buffers
+  vector<RunIterator*> iters;
+  vector<char*> output_buffers;
+
+  // Lambda for freeing the buffers of the concurrent merges
+  auto free_buffers = [&] () {
+    for (size_t i = 0; i < iters.size(); i++) {
+      delete iters[i];
+    }
+    for (size_t i = 0; i < output_buffers.size(); i++) {
+      budget_free(output_buffers[i]);
+    }
+    iters.clear();
+    output_buffers.clear();
+  };
+
   // Repeat for the required number of passes
   for (int pass = 0; pass < num_passes; pass++) {
 
-    // If this is the final pass, ensure we're writing to the output file
+    // A pass that merges only some of the runs leaves the others untouched
+    bool partial = plan[pass].runs_merged < plan[pass].num_runs;
+
+    // A partial pass merges the shortest runs (ties in the order they were
+    // written, which is where they start)
+    if (partial) {
+      sort(runs.begin(), runs.end(), [] (const Run& r1, const Run& r2) {
+        return r1.length < r2.length || (r1.length == r2.length && r1.start_pos < r2.start_pos);
+      });
+    }
+
+    // The number of records the pass merges
+    long pass_records = 0;
+    for (long j = 0; j < plan[pass].runs_merged; j++) {
+      pass_records += runs[j].length;
+    }
+
+    // If this is the final pass, ensure we're writing to the output file,
+    // in text. Otherwise the merged runs go into a new extent of the
+    // scratch file.
+    RunFormat pass_format = run_format;
+    int out_fd = store->fd;
+    long output_start;
     if (pass == num_passes - 1) {
-      curr_pass_output = output_file;
+      pass_format = out_format;
+      output_start = 0;
+      out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (out_fd < 0) {
+        cout << "could not open " << output_file << " for merging runs" << endl;
+        exit(1);
+      }
+    } else {
+      output_start = store->allocate(pass_records * run_format.stride);
     }
 
-    // Do one pass of the sort
-    while (runs_sorted != num_runs) {
+    // Merge m merges inputs[m * group_size] up to (but not including)
+    // inputs[(m + 1) * group_size], or the end of the inputs: the runs to be
+    // merged are taken fan-in at a time (fewer at the very end of the list)
+    const Run *inputs = runs.data();
+    long num_inputs = plan[pass].runs_merged;
+    long group_size = plan[pass].fan_in;
+
+    // A pass whose runs make up a single merge (the final pass, or a first
+    // pass that merges just one group) would run on one thread, so split it
+    // into merges of disjoint key ranges instead
+    bool partitioned = (num_inputs + group_size - 1) / group_size == 1 && num_threads > 1;
+    if (partitioned) {
+      // Partitioning reads keys out of the runs, so it needs memory the
+      // previous pass's buffers are holding
+      free_buffers();
+      concurrency = 0;
+      partition_runs(helper, runs.data(), num_inputs, input_format, rc, num_threads,
+                     merge_capacity, sections);
+      inputs = sections.data();
+      group_size = num_inputs;
+      num_inputs = sections.size();
+    }
+    auto merge_end = [&] (long m) {
+      return min(num_inputs, (m + 1) * group_size);
+    };
+
+    // Every pass writes the merges out in order, so each merged run starts
+    // after all the records merged before it, and every merge can write its
+    // output independently of the others
+    merged_runs.clear();
+    long records_merged = 0;
+    for (long m = 0; m * group_size < num_inputs; m++) {
+      Run merged_run {output_start + records_merged * pass_format.stride, 0};
+      for (long j = m * group_size; j < merge_end(m); j++) {
+        merged_run.length += inputs[j].length;
+      }
+      merged_runs.push_back(merged_run);
+      records_merged += merged_run.length;
+    }
+    int num_merges = merged_runs.size();
+
+    // Run as many merges at once as merge_concurrency allows. The fewer
+    // runs a merge has, the larger its buffers.
+    int pass_fan_in = max(1L, min(group_size, num_inputs));
+    int pass_concurrency = merge_concurrency(num_merges, pass_fan_in);
+    if (pass_concurrency != concurrency || pass_fan_in != fan_in) {
+      free_buffers();
+      concurrency = pass_concurrency;
+      fan_in = pass_fan_in;
+      merge_buf_size = merge_buffer_size(concurrency, fan_in);
+      for (int i = 0; i < concurrency * fan_in; i++) {
+        iters.push_back(new RunIterator(merge_buf_size, &schema, input_format, use_mmap, io, store));
+      }
+      for (int i = 0; i < concurrency; i++) {
+        output_buffers.push_back(budget_alloc(merge_buf_size));
+      }
+    }
 
-      // The number of runs remaining to be sorted
-      int runs_remaining = num_runs - runs_sorted;
+    // The index of the next merge to be started
+    atomic<int> next_merge(0);
 
-      // The number of buffers we actually need for the current merge iteration.
-      // This will be < k when we reach the end of the input file.
-      buffers_needed = runs_remaining < k ? runs_remaining : k;
+    // Lambda for one merge thread: takes the next merge to be done and
+    // merges its runs using the thread's own buffers, until none are left
+    auto merge_thread = [&] (int t) {
+      RunIterator **thread_iters = &iters[t * fan_in];
+      for (int m = next_merge++; m < num_merges; m = next_merge++) {
 
-      // Allocate the buffers needed to merge these runs
-      for (int j = 0; j < buffers_needed; j++) {
+        // The number of buffers we actually need for the current merge.
+        // This will be < fan_in when we reach the end of the runs.
+        int buffers_needed = merge_end(m) - m * group_size;
 
-        // The start position for the current run
-        int start_pos = (run_length * (schema.total_record_length + 1)) * runs_sorted;
+        // Allocate the buffers needed to merge these runs
+        for (int j = 0; j < buffers_needed; j++) {
+          Run run = inputs[m * group_size + j];
 
-        // If this is the start position for the first of the runs, this will
-        // also be the start position for the current merge operation.
-        if (j == 0) {
-          merge_start_pos = start_pos;
+          // reset the iterator for this run
+          thread_iters[j]->reset(helper, run.start_pos, run.length);
         }
 
-        // reset the iterator for this run
-        iters[j]->reset(curr_pass_input, start_pos, run_length);
-
-        // The number of runs that have been sorted so far. 
-        runs_sorted++;
+        // Merge the runs
+        merge_runs(thread_iters, buffers_needed, out_fd, merged_runs[m].start_pos, merge_buf_size,
+                   output_buffers[t], rc, engine, io, pass_format);
       }
+    };
 
-      // Merge the runs
-      merge_runs(iters, buffers_needed, curr_pass_output, merge_start_pos, buf_size, output_buffer, rc);
+    // Do one pass of the sort, with this thread as merge thread 0
+    vector<thread> merge_threads;
+    for (int t = 1; t < concurrency; t++) {
+      merge_threads.push_back(thread(merge_thread, t));
+    }
+    merge_thread(0);
+    for (size_t t = 0; t < merge_threads.size(); t++) {
+      merge_threads[t].join();
     }
 
-    // Runs are now at most k times their previous length
-    run_length *= k;
-
-    // Update the number of runs for the next iteration
-    num_runs = ceil((double) num_runs / k);
+    if (out_fd != store->fd) {
+      close(out_fd);
+    }
 
-    // Reset the number of sorted runs
-    runs_sorted = 0;
+    // The key ranges of a partitioned merge are back to back, and together
+    // make up a single run
+    if (partitioned) {
+      merged_runs.assign(1, Run {output_start, records_merged});
+    }
 
-    // Swap input and output files
-    char* temp = curr_pass_input;
-    curr_pass_input = curr_pass_output;
-    curr_pass_output = temp;
+    // The merged runs take the place of the runs merged into them, ahead of
+    // any runs passed through, as the input to the next pass
+    copy(merged_runs.begin(), merged_runs.end(), runs.begin());
+    runs.erase(runs.begin() + merged_runs.size(), runs.begin() + plan[pass].runs_merged);
   }
 
-  // Free the iterators, the output buffer, and the schema
-  for (int i = 0; i < k; i++) {
-    delete iters[i];
-  }
-  free(output_buffer);
+  // Free the iterators, the output buffers, and the schema
+  free_buffers();
+  cout << "peak memory : " << budget.peak << " of " << mem_capacity << " bytes" << endl;
+  delete io;
+  delete store;
   free(schema.attrs);
   free(schema.sort_attrs);
 